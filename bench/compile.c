@@ -0,0 +1,132 @@
+/*
+ * Compile time against expression size.  Expressions of a few shapes
+ * are compiled at sizes growing fourfold, and the time per node as
+ * parsed is printed, which stays flat for a compiler taking time
+ * linear in what it is given and grows with the size otherwise.  The
+ * smallest is compiled again at the end, which should take no longer
+ * for the context having compiled the largest.
+ *
+ *   cc -O2 -DEXPJIT_NO_MAIN -I.. compile.c ../expjit3.c -o compile
+ *   ./compile [max terms [target]]
+ *
+ * The values are not checked, see test/large.c and random.c for that.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "expjit3.h"
+
+// Writes an expression of n terms to p, returning its end
+static char *sum_of_products(char *p, int n)
+{
+        for (int i = 0; i < n; ++i)
+                p += sprintf(p, "%s(x+%d)*(y+%d)", i ? "+" : "", i % 1000, i % 999);
+        return p;
+}
+
+static char *product_of_sums(char *p, int n)
+{
+        for (int i = 0; i < n; ++i)
+                p += sprintf(p, "%s(a+%d)", i ? "*" : "", i % 100);
+        return p;
+}
+
+// x*x*...*x*y + x*x*...*x*z, which share n/2 factors
+static char *shared_power(char *p, int n)
+{
+        for (int k = 0; k < 2; ++k) {
+                for (int i = 0; i < n / 2; ++i)
+                        p += sprintf(p, "x*");
+                p += sprintf(p, k ? "z" : "y+");
+        }
+        return p;
+}
+
+// Products of a few random variables and sums, for many distinct factors
+static char *polynomial(char *p, int n)
+{
+        srand(n);
+        for (int i = 0; i < n; ++i)
+                p += sprintf(p, "%s%c*(%c+%d)*%c*%d", i ? "+" : "",
+                             "abcxyz"[rand() % 6], "abcxyz"[rand() % 6], rand() % 50,
+                             "abcxyz"[rand() % 6], rand() % 10);
+        return p;
+}
+
+static const struct shape {
+        const char *name;
+        char *(*gen)(char *p, int n);
+} shapes[] = {
+        { "sum of products", sum_of_products },
+        { "product of sums", product_of_sums },
+        { "shared power", shared_power },
+        { "polynomial", polynomial },
+};
+
+// Variables, constants and operators, which is what the parser makes nodes of
+static long nodes(const char *s)
+{
+        long n = 0;
+
+        for (; *s; ++s)
+                n += *s != '(' && *s != ')' &&
+                     !(*s >= '0' && *s <= '9' && s[1] >= '0' && s[1] <= '9');
+        return n;
+}
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int time_compile(expjit_t j, char *source, const struct shape *s, int n, const char *note)
+{
+        *s->gen(source, n) = 0;
+
+        // Small ones are compiled repeatedly for a measurable time
+        double t = now(), dt;
+        int reps = 0;
+        do {
+                expjit_fn_t f = expjit_compile(j, source);
+                if (!f) {
+                        printf("%s, %d terms: %s\n", s->name, n, expjit_error(j));
+                        return -1;
+                }
+                expjit_release(f);
+                reps++;
+        } while ((dt = now() - t) < 0.1);
+
+        long k = nodes(source);
+        printf("%s, %d terms, %ld nodes%s: %.3f ms, %.0f ns per node\n",
+               s->name, n, k, note, dt / reps * 1e3, dt / reps / k * 1e9);
+        fflush(stdout);
+        return 0;
+}
+
+int main(int argc, char **argv)
+{
+        int max = argc > 1 ? atoi(argv[1]) : 1 << 20;
+        char *source = malloc((size_t) max * 32 + 1);
+        expjit_t j = expjit_new();
+
+        if (max < 1 || (argc > 2 && expjit_set_target(j, argv[2]) < 0)) {
+                fprintf(stderr, "usage: %s [max terms [target]]\n", argv[0]);
+                return 2;
+        }
+
+        for (unsigned i = 0; i < sizeof shapes / sizeof *shapes; ++i)
+                for (int n = 1000; n <= max; n *= 4)
+                        if (time_compile(j, source, &shapes[i], n, "") < 0)
+                                return 1;
+
+        // Having compiled large ones must not slow down small ones
+        if (time_compile(j, source, &shapes[0], 1000, ", again") < 0)
+                return 1;
+
+        expjit_free(j);
+        free(source);
+        return 0;
+}
@@ -0,0 +1,200 @@
+/*
+ * Random expressions, for checking and measuring the compiler.
+ *
+ * Each of n expressions, nested up to a depth, is compiled, run, and
+ * checked against an evaluator with wrapping 32-bit arithmetic.  What
+ * is reported is the total code size and, for rv64, the simulator's
+ * counts, or for code that runs natively, the average time per call.
+ * Expression i is generated from srand(i), so runs are repeatable, and
+ * deep ones are the high register pressure cases.
+ *
+ *   cc -O2 -DEXPJIT_NO_MAIN -I.. random.c ../expjit3.c -o random
+ *   ./random [-ackN] [-n count] [-d depth] [-m target] [-t core]
+ *
+ * -a and -c pass the variables as arguments or in a compact env, -m
+ * and -t are as for the expjit3 driver, -k keeps the constants small,
+ * and -N leaves out the polynomial normal form, to see what it saves.
+ * Exits non-zero if any value is wrong.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "expjit3.h"
+
+static char *out;
+static int max_depth, small;
+
+static void gen(int depth)
+{
+        int leaf = rand() % 10 < 3, k;
+
+        if (depth >= max_depth || leaf) {
+                if (rand() % 2) {
+                        *out++ = "abcxyz"[rand() % 6];
+                        return;
+                }
+                k = rand() % 6;
+                if (small)
+                        k = 5;
+                out += sprintf(out, "%d",
+                               k == 0 ? rand() % 10 :
+                               k == 1 ? rand() % 4096 :
+                               k == 2 ? rand() :
+                               k == 3 ? 1 << rand() % 31 :
+                               k == 4 ? rand() % 5 * 2048 + rand() % 3 :
+                               rand() % 100);
+                return;
+        }
+
+        int paren = rand() % 2;
+        if (paren)
+                *out++ = '(';
+        gen(depth + 1);
+        *out++ = rand() % 2 ? '+' : '*';
+        gen(depth + 1);
+        if (paren)
+                *out++ = ')';
+}
+
+// The reference: + and * of variables and constants, in parentheses
+static const char *p;
+static int *penv;
+
+static unsigned sum(void);
+
+static unsigned factor(void)
+{
+        unsigned v = 0;
+
+        if (*p == '(') {
+                p++;
+                v = sum();
+                p++;
+        } else if (*p >= '0' && *p <= '9')
+                while (*p >= '0' && *p <= '9')
+                        v = 10 * v + *p++ - '0';
+        else
+                v = penv[(unsigned char) *p++];
+        return v;
+}
+
+static unsigned product(void)
+{
+        unsigned v = factor();
+
+        while (*p == '*')
+                p++, v *= factor();
+        return v;
+}
+
+static unsigned sum(void)
+{
+        unsigned v = product();
+
+        while (*p == '+')
+                p++, v += product();
+        return v;
+}
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+        static char source[1 << 22];
+        struct expjit_sim_stats st, total = { 0 };
+        expjit_t j = expjit_new();
+        int n = 3000, wrong = 0, opt, env[256], compact[64];
+        unsigned long bytes = 0, calls = 0;
+        double seconds = 0;
+
+        max_depth = 9;
+        while ((opt = getopt(argc, argv, "acd:km:Nn:t:")) != -1)
+                switch (opt) {
+                case 'a': expjit_set_args(j, 1); break;
+                case 'c': expjit_set_compact(j, 1); break;
+                case 'd': max_depth = atoi(optarg); break;
+                case 'k': small = 1; break;
+                case 'N': expjit_set_normal(j, 0); break;
+                case 'n': n = atoi(optarg); break;
+                case 'm':
+                        if (expjit_set_target(j, optarg) < 0)
+                                goto usage;
+                        break;
+                case 't':
+                        if (expjit_set_tune(j, optarg) < 0)
+                                goto usage;
+                        break;
+                default:
+                usage:
+                        fprintf(stderr, "usage: %s [-ackN] [-n count] [-d depth] [-m target] [-t core]\n", argv[0]);
+                        return 2;
+                }
+
+        for (int i = 0; i < n; ++i) {
+                const char *layout;
+                int *e = env, want, got;
+                expjit_fn_t f;
+
+                srand(i);
+                out = source;
+                gen(0);
+                *out = 0;
+                for (int c = 0; c < 256; ++c)
+                        env[c] = rand() % 2001 - 1000;
+
+                f = expjit_compile(j, source);
+                if (!f) {
+                        printf("%s: %s\n", source, expjit_error(j));
+                        wrong++;
+                        continue;
+                }
+                if ((layout = expjit_layout(f))) {
+                        for (int c = 0; layout[c]; ++c)
+                                compact[c] = env[(unsigned char) layout[c]];
+                        e = compact;
+                }
+
+                p = source;
+                penv = env;
+                want = sum();
+                bytes += expjit_code_size(f);
+                if (strcmp(expjit_target(f), "rv64") == 0) {
+                        got = expjit_simulate(f, e, &st);
+                        total.insns += st.insns;
+                        total.loads += st.loads;
+                        total.muls += st.muls;
+                        total.cycles += st.cycles;
+                } else if (expjit_entry(f) || expjit_args_entry(f)) {
+                        double t = now();
+                        got = expjit_call(f, e);
+                        for (int r = 0; r < 99; ++r)
+                                expjit_call(f, e);
+                        seconds += now() - t;
+                        calls += 100;
+                } else {
+                        expjit_release(f);
+                        continue;       // compiled only
+                }
+                if (got != want && wrong++ < 5)
+                        printf("%s: got %d, want %d\n", source, got, want);
+                expjit_release(f);
+        }
+
+        printf("%d/%d wrong, %lu bytes", wrong, n, bytes);
+        if (total.insns)
+                printf(", %lu insns, %lu loads, %lu muls, %lu cycles",
+                       total.insns, total.loads, total.muls, total.cycles);
+        if (calls)
+                printf(", %.2f ns per call", seconds / calls * 1e9);
+        printf("\n");
+        expjit_free(j);
+        return wrong != 0;
+}
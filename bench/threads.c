@@ -0,0 +1,83 @@
+/*
+ * Compile throughput with several threads, each with a context of its
+ * own, sharing only the code heap.  Each thread compiles, calls, and
+ * releases the same expression over and over for a while.
+ *
+ *   cc -O2 -pthread -DEXPJIT_NO_MAIN -I.. threads.c ../expjit3.c -o threads
+ *   ./threads [max threads [expression]]
+ *
+ * Exits non-zero if any call gives the wrong value.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "expjit3.h"
+
+static const char *source = "(1 + x*3 + 4*(5 + y)) * (1 + x*3 + 4*(5 + y)) + z*z";
+static int want;
+static double seconds = 0.5;
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *worker(void *arg)
+{
+        long *done = arg;
+        int env[256] = { ['x'] = 2, ['y'] = 3, ['z'] = 4 };
+        expjit_t j = expjit_new();
+        double end = now() + seconds;
+
+        for (*done = 0; now() < end; ++*done) {
+                expjit_fn_t f = expjit_compile(j, source);
+
+                if (!f || expjit_call(f, env) != want) {
+                        *done = -1;
+                        break;
+                }
+                expjit_release(f);
+        }
+        expjit_free(j);
+        return NULL;
+}
+
+int main(int argc, char **argv)
+{
+        int max = argc > 1 ? atoi(argv[1]) : 8, env[256] = { ['x'] = 2, ['y'] = 3, ['z'] = 4 };
+        pthread_t thread[64];
+        long done[64];
+        expjit_t j = expjit_new();
+        expjit_fn_t f;
+
+        if (argc > 2)
+                source = argv[2];
+        if (max < 1 || max > 64 || !(f = expjit_compile(j, source))) {
+                fprintf(stderr, "usage: %s [max threads (1-64) [expression]]\n", argv[0]);
+                return 2;
+        }
+        want = expjit_call(f, env);
+        expjit_release(f);
+        expjit_free(j);
+
+        for (int n = 1; n <= max; n *= 2) {
+                long total = 0;
+
+                for (int i = 0; i < n; ++i)
+                        pthread_create(&thread[i], NULL, worker, &done[i]);
+                for (int i = 0; i < n; ++i) {
+                        pthread_join(thread[i], NULL);
+                        if (done[i] < 0) {
+                                printf("%d threads: wrong value\n", n);
+                                return 1;
+                        }
+                        total += done[i];
+                }
+                printf("%d threads: %.0f compiles/s\n", n, total / seconds);
+        }
+        return 0;
+}
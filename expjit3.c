@@ -7,19 +7,27 @@
  * - AST transformation, and
  * - (dynamic) native code generation.
  *
- * This example expects to be run on a RISC-V RV64GC.
+ * This example runs on a RISC-V RV64GC, an x86-64, or an AArch64, and
+ * RISC-V code can also run anywhere in a small built-in simulator.
  *
  * Tommy Thorn 2006-09-18, placed in the public domain.
  * Tommy Thorn 2019-02-22, ported to RISC-V
  */
 
+#define _GNU_SOURCE             // for memfd_create()
+
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <stdint.h>
+#include <unistd.h>
+
+#include "expjit3.h"
 
 /*
  * Lexical analysis
@@ -33,44 +41,110 @@ typedef enum {
         NAME,
 } token_t;
 
-static char    *s;              // Source code pointer
-static token_t  lookahead;
-static int      intValue;
-static char    *symbolValue;    // Pointing to a place in the source.
-static unsigned symbolLength;   // Length of same (which is *not* zero terminated)
-                                // XXX Not used in this example
+/*
+ * All state of a compilation lives in a context rather than in
+ * globals, so any number of threads can compile at the same time as
+ * long as each uses its own context.
+ */
+typedef uint32_t ast_t;         // a node, see new_node()
+struct expjit {
+        // Lexical analysis
+        const char *s;                  // Source code pointer
+        token_t  lookahead;
+        int      intValue;
+        const char *symbolValue;        // Pointing to a place in the source.
+        unsigned symbolLength;          // Length of same (which is *not* zero terminated)
+                                        // XXX Not used in this example
+
+        // AST arena and CSE table, see new_node() and cse_lookup()
+        struct chunk **chunk;
+        ast_t nnodes;
+        unsigned nchunks, chunks_size;
+        ast_t *cse_table;
+        unsigned cse_size, cse_count;
+
+        // Garbage collection, see collect()
+        ast_t free_nodes;               // chained through `l'
+        unsigned nodes_used, gc_threshold;
+        ast_t *roots;
+        int nroots, roots_size;
+
+        // Polynomial normal form, see norm() and factorise()
+        int normal;                     // to bring sums into it
+        struct mono *monos, *mtmp;
+        int nmonos, monos_size, mtmp_size;
+        struct power *factors;
+        int nfactors, factors_size;
+        struct atom *atoms;
+        int natoms, atoms_size;
+        struct place *occ;
+        int occ_size;
+        int *heads, heads_size;
+        struct group *groups;
+        int ngroups, groups_size;
+
+        // Tree-height reduction, see balance()
+        ast_t *terms;
+        int nterms, terms_size;
+
+        // Code generation
+        const struct target *target;
+        unsigned isa;                   // RISC-V extensions, see rv64_isa()
+        const struct rv_core *core;     // to tune for, see rv64_schedule()
+        int by_args;                    // variables in registers, see bind_args()
+        ast_t vars[256];                // the variables used, by name
+        char args[9];                   // in argument order
+        int compact;                    // env in first use order, see env_index()
+        char layout[64];                // that order
+        uint8_t *code, *cp, *code_end;  // see emit8()
+        int reg_poll[32];               // free registers are reg_poll[next_free .. nregs)
+        int nregs, next_free;
+        ast_t live[32];                 // values in registers, oldest first
+        int nlive;
+        ast_t pinned[4];                // operands of the instruction at hand
+        int npinned;
+        unsigned used_regs;
+        int *free_slots;                // stack frame slots for spilling
+        int nfree_slots, nslots, slots_size;
+        int frame;                      // its size, see finish_frame()
+
+        ast_t root;                     // of the last expression compiled
+        char error[80];                 // why it failed, if it did
+};
 
 /*
  * Produce the next token in `lookahead' from the source code pointed
  * by `s'.  Integer constants and name leave information in auxiliary
  * variables intValue, symbolValue, and symbolValue.
  */
-static void nexttoken(void)
+static void nexttoken(expjit_t j)
 {
-        while (isspace(*s))
-                ++s;
-
-        if (isdigit(*s)) {
-                intValue = 0;
-                lookahead = INT;
-                while (isdigit(*s))
-                        intValue = 10*intValue + *s++ - '0';
-        } else if (isalpha(*s)) {
-                lookahead = NAME;
-                symbolValue = s;
-                while (isalnum(*s))
-                        ++s;
-                symbolLength = symbolValue - s;
-        } else
-                lookahead = *s++;
+        while (isspace(*j->s))
+                ++j->s;
+
+        if (isdigit(*j->s)) {
+                j->intValue = 0;
+                j->lookahead = INT;
+                while (isdigit(*j->s))
+                        j->intValue = 10u*j->intValue + *j->s++ - '0';
+        } else if (isalpha(*j->s)) {
+                j->lookahead = NAME;
+                j->symbolValue = j->s;
+                while (isalnum(*j->s))
+                        ++j->s;
+                j->symbolLength = j->symbolValue - j->s;
+        } else if (*j->s)
+                j->lookahead = *j->s++;
+        else
+                j->lookahead = END_OF_FILE;
 }
 
-static void match(token_t expect)
+static void match(expjit_t j, token_t expect)
 {
-        if (lookahead != expect)
-                lookahead = ERROR; // Terminate all parsing
+        if (j->lookahead != expect)
+                j->lookahead = ERROR; // Terminate all parsing
         else
-                nexttoken();
+                nexttoken(j);
 }
 
 
@@ -80,20 +154,242 @@ static void match(token_t expect)
  * In general this will be a structure with a tag and a union of
  * alternatives corresponding to the tag, but for this simple example,
  * we can get away with some abuse of structure fields.
+ *
+ * A node is an index into chunks of 4096, the top bits picking the
+ * chunk and the low 12 the node in it.  Each chunk holds two parallel
+ * arrays: what the parser, CSE and the garbage collector look at,
+ * packed into 16 bytes, and what only the passes after parsing need.
+ * Walking the tree thus touches a quarter of a cache line per node
+ * rather than most of one.  A chunk, once allocated, stays where it
+ * is, so growing never copies the nodes there are.  Node 0 is never
+ * used, so 0 serves as no node.
  */
 
-typedef struct node *ast_t;
-static struct node {
-        token_t kind;   // great correspondence means we reuse the type here
+struct node {
+        uint16_t kind;  // a token_t, great correspondence means we reuse it here
+        uint8_t mark;   // reachable, see collect()
         ast_t l, r;     // left and right subtrees
         int intValue;   // irrelevant unless kind == INT
+};
+
+struct node_cg {
+        int uses;       // how many times the value is used, see count_uses()
+        int shared;     // uses not yet generated
+        int spill;      // the stack slot holding the value, if any
+        int need;       // registers needed to evaluate it, see label()
+        ast_t norm;     // the same in normal form, see norm()
+        int atom;       // its count there, see factorise()
+        int8_t alloc;   // if not NOREG, the desired register
+        int8_t reg;     // for the code generation
+};
+
+#define CHUNK_BITS  12
+#define CHUNK_NODES (1 << CHUNK_BITS)
+
+struct chunk {
+        struct node node[CHUNK_NODES];
+        struct node_cg cg[CHUNK_NODES];
+};
+
+// The fields of node `t' in context `j'
+#define NODE(t)  (j->chunk[(t) >> CHUNK_BITS]->node[(t) & (CHUNK_NODES - 1)])
+#define KIND(t)  (NODE(t).kind)
+#define MARK(t)  (NODE(t).mark)
+#define LEFT(t)  (NODE(t).l)
+#define RIGHT(t) (NODE(t).r)
+#define VALUE(t) (NODE(t).intValue)
+#define CG(t)    (j->chunk[(t) >> CHUNK_BITS]->cg[(t) & (CHUNK_NODES - 1)])
+
+#define NOREG  -1       // no register (yet)
+#define NOSLOT -1
+
+static void *xmalloc(size_t size)
+{
+        void *p = malloc(size);
+        if (!p) {
+                perror("malloc");
+                abort();
+        }
+        return p;
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+        p = realloc(p, size);
+        if (!p) {
+                perror("realloc");
+                abort();
+        }
+        return p;
+}
+
+/*
+ * Nodes are bump allocated from the chunks, a new one being added when
+ * the last is full.  All nodes are released at once by reset_nodes(),
+ * which keeps the chunks for reuse by the next compilation, and
+ * garbage ones by collect(), which puts them on a free list used
+ * first.
+ */
+static ast_t new_node(expjit_t j, token_t kind, ast_t l, ast_t r, int k)
+{
+        ast_t t;
+
+        j->nodes_used++;
+        if (j->free_nodes) {
+                t = j->free_nodes;
+                j->free_nodes = LEFT(t);
+        } else {
+                if (j->nnodes >> CHUNK_BITS == j->nchunks) {
+                        assert(j->nchunks < (UINT32_MAX >> CHUNK_BITS));
+                        if (j->nchunks == j->chunks_size) {
+                                j->chunks_size = j->chunks_size ? 2 * j->chunks_size : 16;
+                                j->chunk = xrealloc(j->chunk, j->chunks_size * sizeof *j->chunk);
+                        }
+                        j->chunk[j->nchunks++] = xmalloc(sizeof **j->chunk);
+                }
+                t = j->nnodes++;
+        }
+
+        KIND(t) = kind;
+        LEFT(t) = l;
+        RIGHT(t) = r;
+        VALUE(t) = k;
+        CG(t).uses = 0;
+        CG(t).shared = 0;
+        CG(t).alloc = NOREG;
+        CG(t).reg = NOREG;
+        CG(t).spill = NOSLOT;
+        CG(t).need = 0;
+        CG(t).norm = 0;
+        CG(t).atom = 0;
+        MARK(t) = 0;
+        return t;
+}
+
+/*
+ * Hash-consing.  Every node built is entered in an open addressing
+ * table keyed on (kind, l, r, intValue), so finding a common
+ * subexpression takes a probe or two rather than a scan over all the
+ * nodes built so far.  The table is doubled whenever it gets half
+ * full, so `j->cse_size' is always a power of two, or 0 before the
+ * first node.
+ */
+#define MIN_CSE 1024
+
+static ast_t *cse_lookup(expjit_t j, token_t kind, ast_t l, ast_t r, int k)
+{
+        uint64_t h = kind;
+        h = (h ^ l) * 0x9E3779B97F4A7C15u;
+        h = (h ^ r) * 0x9E3779B97F4A7C15u;
+        h = (h ^ (unsigned) k)  * 0x9E3779B97F4A7C15u;
+
+        // Linear probing until we find the node or an empty slot
+        for (unsigned i = h >> 32;; ++i) {
+                ast_t *slot = &j->cse_table[i & (j->cse_size - 1)];
+                ast_t p = *slot;
+                if (!p || (KIND(p) == kind && LEFT(p) == l && RIGHT(p) == r && VALUE(p) == k))
+                        return slot;
+        }
+}
+
+static void cse_grow(expjit_t j)
+{
+        ast_t *old = j->cse_table;
+        unsigned old_size = j->cse_size;
+
+        j->cse_size = old_size ? 2 * old_size : MIN_CSE;
+        j->cse_table = xmalloc(j->cse_size * sizeof *j->cse_table);
+        memset(j->cse_table, 0, j->cse_size * sizeof *j->cse_table);
 
-        int shared;     // this node is shared (eg. a common sub expression)
-        int alloc;      // if nonzero, the desired register
-        int reg;        // for the code generation
-} nodes[9999];
+        for (unsigned i = 0; i < old_size; ++i)
+                if (old[i])
+                        *cse_lookup(j, KIND(old[i]), LEFT(old[i]), RIGHT(old[i]), VALUE(old[i])) = old[i];
+        free(old);
+}
+
+/*
+ * Forget all nodes, eg. between compilations.  The chunks are kept
+ * for reuse, but the CSE table needs clearing, which takes as long as
+ * it is big.  So a table grown for a large expression is dropped
+ * instead, or every compilation after it would take as long.
+ */
+static void reset_nodes(expjit_t j)
+{
+        j->nnodes = 1;                  // skipping node 0
+        if (j->cse_size > MIN_CSE) {
+                free(j->cse_table);
+                j->cse_table = NULL;
+                j->cse_size = 0;
+        } else if (j->cse_count)
+                memset(j->cse_table, 0, j->cse_size * sizeof *j->cse_table);
+        j->cse_count = 0;
+        j->free_nodes = 0;
+        j->nodes_used = 0;
+        j->gc_threshold = CHUNK_NODES;
+        j->nroots = 0;
+}
+
+/*
+ * Garbage collection.
+ *
+ * The rewrites in mk() leave nodes behind that nothing refers to, and
+ * for a large expression these add up.  So the parser now and then
+ * marks what is reachable from its partial results, which it keeps on
+ * a root stack, and sweeps the rest onto the free list.  The CSE table
+ * is then rebuilt from the nodes that are left.  This is only safe
+ * between calls to mk(), as the nodes it works on aren't roots.
+ */
+static void push_root(expjit_t j, ast_t t)
+{
+        if (j->nroots == j->roots_size) {
+                j->roots_size = j->roots_size ? 2 * j->roots_size : 64;
+                j->roots = xrealloc(j->roots, j->roots_size * sizeof *j->roots);
+        }
+        j->roots[j->nroots++] = t;
+}
+
+static void pop_root(expjit_t j)
+{
+        j->nroots--;
+}
 
-static int next = 0;
+// Chains lean left, so those are followed by looping, not recursion
+static void mark(expjit_t j, ast_t t)
+{
+        for (; !MARK(t); t = LEFT(t)) {
+                MARK(t) = 1;
+                if (KIND(t) == INT || KIND(t) == NAME)
+                        break;
+                mark(j, RIGHT(t));
+        }
+}
+
+static void collect(expjit_t j)
+{
+        ast_t t;
+
+        for (int i = 0; i < j->nroots; ++i)
+                mark(j, j->roots[i]);
+
+        memset(j->cse_table, 0, j->cse_size * sizeof *j->cse_table);
+        j->cse_count = 0;
+        j->free_nodes = 0;
+        j->nodes_used = 0;
+        for (t = j->nnodes; --t > 0;)   // so the free list runs upwards
+                if (MARK(t)) {
+                        MARK(t) = 0;
+                        *cse_lookup(j, KIND(t), LEFT(t), RIGHT(t), VALUE(t)) = t;
+                        j->cse_count++;
+                        j->nodes_used++;
+                } else {
+                        KIND(t) = END_OF_FILE;  // free
+                        LEFT(t) = j->free_nodes;
+                        j->free_nodes = t;
+                }
+
+        // Collect again when the live nodes have doubled
+        j->gc_threshold = 2 * j->nodes_used > CHUNK_NODES ? 2 * j->nodes_used : CHUNK_NODES;
+}
 
 /*
  * Building the AST is a key operation as this is a prime opportunity
@@ -104,74 +400,155 @@ static int next = 0;
  * undesirable on their own, but are included to expose more
  * opportunities for other transformations.
  *
- * XXX There is a small bug below: the rewriting can cause nodes to
- * become unrefererened ("garbage"), which is fine. However, if such a
- * node is subsequently rediscovered by the CSE it may be marked as
- * shared when it really isn't and thus cause a needless saving of the
- * value in codegen. There are several ways to fix it, but as none of
- * them are very elegent and the bug fairly innocent, I'll leave it
- * unfixed for now. (FWIW, the best way to fix this is to delay the
- * marking of nodes as "shared" until after parsing, but before code
- * generation, using a new tree traversal).
+ * The rewriting can cause nodes to become unreferenced ("garbage"),
+ * which is fine, but which CSE may still find again.  So how many
+ * times a node is used is only known once the whole expression is
+ * built, and is counted then, see count_uses().
+ *
+ * For CSE to find a*b in b*a, or (a+b)+c in a+(b+c), sums and
+ * products are kept in a canonical form: a chain of the same operator
+ * leaning left, ((t1 + t2) + t3) + t4, with the terms in the order of
+ * before().  As the parser builds sums and products left to right from
+ * terms it has just made, these mostly go on the end of the chain.  A
+ * term that belongs further back than CHAIN_WINDOW terms goes on the
+ * end all the same, as moving it there takes rebuilding the chain
+ * behind it, which for long sums would make parsing quadratic.  The
+ * parser instead sorts each sum and product once it has all of its
+ * terms, see sort_chain().
  */
-static ast_t mk(token_t kind, ast_t l, ast_t r, int k)
+#define CHAIN_WINDOW 8
+
+// Does term `a' go before term `b' in a chain?  Constants go last, so
+// they are folded together and end up as immediates; other terms are
+// ordered by their node number, which is as good as any.
+static int before(expjit_t j, ast_t a, ast_t b)
 {
-        // CSE
-        ast_t p, t;
-        if ((kind == '*' || kind == '+') && l->kind == INT)
-                t = l, l = r, r = t; // move constants to the right
+        if (KIND(b) == INT)
+                return KIND(a) != INT;
+        return KIND(a) != INT && a < b;
+}
 
-        for (p = &nodes[0]; p != &nodes[next]; ++p)
-                if (p->kind == kind && p->l == l && p->r == r && p->intValue == k) {
-                        p->shared++;
-                        return p;
-                }
+static ast_t mk(expjit_t j, token_t kind, ast_t l, ast_t r, int k)
+{
+        ast_t *slot, t;
+
+        if (kind == '*' || kind == '+') {
+                // a + (b + c) -> (a + b) + c
+                if (KIND(r) == kind)
+                        return mk(j, kind, mk(j, kind, l, LEFT(r), 0), RIGHT(r), 0);
+
+                if (KIND(l) == kind) {
+                        // (x + k1) + k2 -> x + (k1 + k2)
+                        if (KIND(RIGHT(l)) == INT && KIND(r) == INT)
+                                return mk(j, kind, LEFT(l), mk(j, kind, RIGHT(l), r, 0), 0);
+                        // (x + b) + a -> (x + a) + b
+                        ast_t after[CHAIN_WINDOW];
+                        int n = 0;
+                        for (t = l; KIND(t) == kind && before(j, r, RIGHT(t)); t = LEFT(t)) {
+                                if (n == CHAIN_WINDOW) {
+                                        n = 0;  // too far back
+                                        break;
+                                }
+                                after[n++] = RIGHT(t);
+                        }
+                        if (n) {
+                                for (t = mk(j, kind, t, r, 0); n;)
+                                        t = mk(j, kind, t, after[--n], 0);
+                                return t;
+                        }
+                } else if (before(j, r, l))
+                        t = l, l = r, r = t;
+        }
+
+        // CSE
+        if (2 * (j->cse_count + 1) > j->cse_size)
+                cse_grow(j);
+        slot = cse_lookup(j, kind, l, r, k);
+        if (*slot)
+                return *slot;
 
-        // Constant folding (partially)
+        // Constant folding (partially), wrapping around as the code does
         // k1 + k2 -> [k1 + k2]
-        if (kind == '+' && l->kind == INT && r->kind == INT)
-                return mk(INT, 0, 0, l->intValue + r->intValue);
+        if (kind == '+' && KIND(l) == INT && KIND(r) == INT)
+                return mk(j, INT, 0, 0, (int) ((unsigned) VALUE(l) + (unsigned) VALUE(r)));
         // k1 * k2 -> [k1 * k2]
-        if (kind == '*' && l->kind == INT && r->kind == INT)
-                return mk(INT, 0, 0, l->intValue * r->intValue);
+        if (kind == '*' && KIND(l) == INT && KIND(r) == INT)
+                return mk(j, INT, 0, 0, (int) ((unsigned) VALUE(l) * (unsigned) VALUE(r)));
 
         // Dead code elimination / alg. simplification
         // x * 0 -> 0
-        if (kind == '*' && r->kind == INT && r->intValue == 0)
-                return mk(INT, 0, 0, 0);
+        if (kind == '*' && KIND(r) == INT && VALUE(r) == 0)
+                return mk(j, INT, 0, 0, 0);
         // x * 1 -> x
-        if (kind == '*' && r->kind == INT && r->intValue == 1)
+        if (kind == '*' && KIND(r) == INT && VALUE(r) == 1)
                 return l;
         // x + 0 -> x
-        if (kind == '+' && r->kind == INT && r->intValue == 0)
+        if (kind == '+' && KIND(r) == INT && VALUE(r) == 0)
                 return l;
 
         // x + x -> 2 * x
         if (kind == '+' && r == l)
-                return mk('*', mk(INT,0,0,2), l, 0);
-
-        // Move constants to the right
-        // (x + k1) + y -> x + (y + k1)
-        if (kind == '+' && l->kind == '+' && l->r->kind == INT)
-                return mk('+', l->l, mk('+', r, l->r, 0), 0);
-        if (kind == '*' && l->kind == '*' && l->r->kind == INT)
-                return mk('*', l->l, mk('*', r, l->r, 0), 0);
+                return mk(j, '*', mk(j, INT,0,0,2), l, 0);
 
         // (x + k2) * k1 -> x * k1 + k2 * k1
-        if (kind == '*' && r->kind == INT && l->kind == '+' && l->r->kind == INT)
-                return mk('+',
-                          mk('*',l->l,r,0),
-                          mk('*',l->r,r,0),
+        if (kind == '*' && KIND(r) == INT && KIND(l) == '+' && KIND(RIGHT(l)) == INT)
+                return mk(j, '+',
+                          mk(j, '*',LEFT(l),r,0),
+                          mk(j, '*',RIGHT(l),r,0),
                           0);
 
-        nodes[next].kind = kind;
-        nodes[next].l = l;
-        nodes[next].r = r;
-        nodes[next].intValue = k;
-        nodes[next].shared = 1;
-        nodes[next].alloc = 0;
-        nodes[next].reg = 0;
-        return &nodes[next++];
+        t = new_node(j, kind, l, r, k);
+
+        // None of the rewrites above applied, so no new nodes were
+        // made since the lookup and `slot' is still the place to go.
+        j->cse_count++;
+        return *slot = t;
+}
+
+// j->terms is a stack, also used by balance(), label() and codegen()
+static void push_term(expjit_t j, ast_t t)
+{
+        if (j->nterms == j->terms_size) {
+                j->terms_size = j->terms_size ? 2 * j->terms_size : 64;
+                j->terms = xrealloc(j->terms, j->terms_size * sizeof *j->terms);
+        }
+        j->terms[j->nterms++] = t;
+}
+
+static int cmp_node(const void *a, const void *b)
+{
+        ast_t x = *(const ast_t *) a, y = *(const ast_t *) b;
+
+        return x < y ? -1 : x > y;
+}
+
+// The chain `t' of `kind' with all of its terms in the order of
+// before(), rebuilt if mk() left some out of it
+static ast_t sort_chain(expjit_t j, token_t kind, ast_t t)
+{
+        int base = j->nterms, n, i, k;
+        ast_t c, *terms;
+
+        for (c = t; KIND(c) == kind; c = LEFT(c))
+                push_term(j, RIGHT(c));
+        push_term(j, c);
+        n = j->nterms - base;
+        terms = &j->terms[base];
+
+        // The terms are on the stack last first
+        for (i = 1; i < n && !before(j, terms[i - 1], terms[i]); ++i)
+                ;
+        if (i < n) {
+                for (i = k = 0; i < n; ++i)
+                        if (KIND(terms[i]) != INT)
+                                c = terms[k], terms[k++] = terms[i], terms[i] = c;
+                qsort(terms, k, sizeof *terms, cmp_node);
+                for (t = terms[0], i = 1; i < n; ++i)
+                        t = mk(j, kind, t, terms[i], 0);
+        }
+
+        j->nterms = base;
+        return t;
 }
 
 
@@ -182,234 +559,3194 @@ static ast_t mk(token_t kind, ast_t l, ast_t r, int k)
  * Dragon book).
  */
 
-static ast_t pExp(void);
-static ast_t pFactor(void)
+static ast_t pExp(expjit_t j);
+static ast_t pFactor(expjit_t j)
 {
         ast_t v;
-        switch (lookahead) {
+
+        // The partial results of the callers are all roots here
+        if (j->nodes_used >= j->gc_threshold)
+                collect(j);
+
+        switch (j->lookahead) {
         case '(':
-                match('('); v = pExp(); match(')');
+                match(j, '('); v = pExp(j); match(j, ')');
                 break;
 
         case NAME:
-                v = mk(NAME, 0,0, symbolValue[0]); match(NAME);
+                v = mk(j, NAME, 0,0, j->symbolValue[0]); match(j, NAME);
                 break;
 
         case INT:
-                v = mk(INT, 0,0, intValue); match(INT);
+                v = mk(j, INT, 0,0, j->intValue); match(j, INT);
                 break;
+
+        default:
+                // Something to return, though parsing stops here
+                j->lookahead = ERROR;
+                v = mk(j, INT, 0,0, 0);
         }
 
         return v;
 }
 
-static ast_t pTerm(void)
+static ast_t pTerm(expjit_t j)
 {
-        ast_t v = pFactor();
-        while (lookahead == '*')
-                match('*'), v = mk('*',v,pFactor(),0);
-        return v;
+        ast_t v = pFactor(j), r;
+        while (j->lookahead == '*') {
+                match(j, '*');
+                push_root(j, v);
+                r = pFactor(j);
+                pop_root(j);
+                v = mk(j, '*',v,r,0);
+        }
+        return sort_chain(j, '*', v);
 }
 
-static ast_t pExp(void)
+static ast_t pExp(expjit_t j)
 {
-        ast_t v = pTerm();
-        while (lookahead == '+')
-                match('+'), v = mk('+',v,pTerm(),0);
+        ast_t v = pTerm(j), r;
+        while (j->lookahead == '+') {
+                match(j, '+');
+                push_root(j, v);
+                r = pTerm(j);
+                pop_root(j);
+                v = mk(j, '+',v,r,0);
+        }
 
-        return v;
+        return sort_chain(j, '+', v);
 }
 
 
 /*
- * Unparsing the AST.
+ * Polynomial normal form.
  *
- * Both serving as an example of AST traversal and a debugging tool
- * for examining the result of transformations.
+ * An expression is a polynomial in its variables, and it may well be
+ * computed with fewer multiplications than it is written with:
+ * x*y*3 + 2*y*x is x*y*5, x*a + x*b is x*(a + b), and by Horner's rule
+ * a*x*x + b*x + c is x*(a*x + b) + c.  So each sum is expanded into a
+ * list of monomials, each a coefficient times a product of powers of
+ * factors, the like ones are added up, and the sum is rebuilt by
+ * repeatedly taking out the power of the factor that the most
+ * monomials share.  For a polynomial in one variable, that is Horner's
+ * rule.
+ *
+ * Products of sums are not multiplied out, as that can make the
+ * expression exponentially larger, so such a sum is a factor just like
+ * a variable, once in normal form itself.
  */
-static void unparse(ast_t t)
+struct power {
+        ast_t x;
+        unsigned e;             // x^e
+};
+
+struct mono {
+        unsigned coef;          // wrapping around like int arithmetic
+        int first, n;           // the factors are j->factors[first .. first + n)
+        struct power *f;        // the same, once they don't move anymore
+        int group;              // taken out with, see factorise()
+};
+
+static ast_t norm(expjit_t j, ast_t t);
+
+// Makes room for n elements in the array p of *size ones
+static void *reserve(void *p, int *size, int n, size_t elem)
 {
-        if (t->kind == INT)
-                printf("%d", t->intValue);
-        else if (t->kind == NAME)
-                printf("%c", t->intValue);
-        else {
-                printf("(");
-                if (t->shared)
-                        putchar('!');
-                unparse(t->l);
-                printf("%c", t->kind);
-                unparse(t->r);
-                printf(")");
+        if (n <= *size)
+                return p;
+        while (*size < n)
+                *size = *size ? 2 * *size : 64;
+        return xrealloc(p, *size * elem);
+}
+
+static void add_factor(expjit_t j, int m, ast_t t)
+{
+        switch (KIND(t)) {
+        case INT:
+                j->monos[m].coef *= VALUE(t);
+                break;
+
+        case '*':
+                for (; KIND(t) == '*'; t = LEFT(t))
+                        add_factor(j, m, RIGHT(t));
+                add_factor(j, m, t);
+                break;
+
+        case '+':
+                t = norm(j, t);
+                if (KIND(t) != '+') {
+                        add_factor(j, m, t);
+                        break;
+                }
+                // fall through
+        default:
+                j->factors = reserve(j->factors, &j->factors_size, j->nfactors + 1, sizeof *j->factors);
+                j->factors[j->nfactors++] = (struct power) { t, 1 };
+        }
+}
+
+static void add_monos(expjit_t j, ast_t t)
+{
+        if (KIND(t) == '+') {
+                for (; KIND(t) == '+'; t = LEFT(t))
+                        add_monos(j, RIGHT(t));
+                add_monos(j, t);
+                return;
         }
+
+        j->monos = reserve(j->monos, &j->monos_size, j->nmonos + 1, sizeof *j->monos);
+        int m = j->nmonos++;
+        j->monos[m].coef = 1;
+        j->monos[m].first = j->nfactors;
+        j->monos[m].group = -1;
+        add_factor(j, m, t);    // may normalise sums, which use the stacks above
+        j->monos[m].n = j->nfactors - j->monos[m].first;
 }
 
+static int cmp_power(const void *a, const void *b)
+{
+        ast_t x = ((const struct power *) a)->x, y = ((const struct power *) b)->x;
+
+        return x < y ? -1 : x > y;
+}
+
+static int cmp_mono(const void *a, const void *b)
+{
+        const struct mono *x = a, *y = b;
+
+        if (x->n != y->n)
+                return x->n - y->n;
+        for (int i = 0; i < x->n; ++i)
+                if (x->f[i].x != y->f[i].x)
+                        return x->f[i].x < y->f[i].x ? -1 : 1;
+                else if (x->f[i].e != y->f[i].e)
+                        return x->f[i].e < y->f[i].e ? -1 : 1;
+        return 0;
+}
+
+static ast_t times_power(expjit_t j, ast_t t, ast_t x, unsigned e)
+{
+        while (e--)
+                t = mk(j, '*', t, x, 0);
+        return t;
+}
+
+static ast_t product(expjit_t j, const struct mono *m)
+{
+        ast_t p = mk(j, INT, 0, 0, m->coef);
+
+        for (int i = 0; i < m->n; ++i)
+                p = times_power(j, p, m->f[i].x, m->f[i].e);
+        return p;
+}
+
+// The sum of m[0 .. n) as it is
+static ast_t sum(expjit_t j, const struct mono *m, int n)
+{
+        ast_t t = mk(j, INT, 0, 0, 0);
+
+        for (int i = 0; i < n; ++i)
+                t = mk(j, '+', t, product(j, &m[i]), 0);
+        return t;
+}
 
 /*
- * Code generation.
- *
- * Classic template expansion.  Rather than generating fully general
- * code that stores to a stack, we cheat and pretend we have unlimited
- * number of register.  A realistic codegen would do better.
- *
- * Expressions are compiled to leave their results in registers
- * corresponding to the depth of the stack.
+ * Factoring.
  *
- * Common subexpressions are here treated as implicitly store to a
- * local variable.  In a real compiler, this would be more explicit at
- * a higher level, and no special treatment needed here.
- *
- * Ironically, it's actually much simpler to directly generate native
- * x86 code here than some assembler output.
- *
- * Symbol table handling is unrealistically simplistic here.
+ * Finding the most shared factor afresh in what is left after taking
+ * out each one would take time quadratic in the size of the sum.  So
+ * factorise() counts the monomials each factor is in once, lists where
+ * it is, and takes the factors out in the order of their counts,
+ * keeping those up to date as monomials are taken.  Only once all the
+ * monomials of a sum are shared out does it rebuild the groups they
+ * make, as rebuilding a group needs the counts, in j->atoms, for
+ * itself.
  */
+struct atom {
+        ast_t x;                // CG(x).atom is the index of this
+        int count;              // of the monomials left, those with x
+        int occ, nocc;          // they were among j->occ[occ .. occ + nocc)
+        int next;               // with the same count, see factorise()
+};
+
+struct place {
+        int i, k;               // m[i].f[k]
+};
+
+struct group {
+        ast_t x;
+        unsigned e;             // x^e is taken out of
+        int n;                  // as many monomials
+};
+
+#define FACTOR_DEPTH 64         // groups within groups, beyond which sums are left as they are
+
+// Counts the monomials of m[0 .. n) that each factor is in, returning
+// how many factors are in all of them
+static int count_factors(expjit_t j, const struct mono *m, int n)
+{
+        int common = 0;
+
+        j->natoms = 0;
+        for (int i = 0; i < n; ++i)
+                for (int k = 0; k < m[i].n; ++k) {
+                        ast_t x = m[i].f[k].x;
+                        int a = CG(x).atom;
+
+                        if (a >= j->natoms || j->atoms[a].x != x) {
+                                j->atoms = reserve(j->atoms, &j->atoms_size, j->natoms + 1, sizeof *j->atoms);
+                                a = CG(x).atom = j->natoms++;
+                                j->atoms[a].x = x;
+                                j->atoms[a].count = 0;
+                        }
+                        common += ++j->atoms[a].count == n;
+                }
+        return common;
+}
 
-static uint32_t *code, *cp;
-static int env[256] = { ['x'] = 2, ['y'] = 3 };
-static int cse_values[9999], *cse_p = cse_values;
+static struct atom *atom(expjit_t j, ast_t x)
+{
+        return &j->atoms[CG(x).atom];
+}
 
-static const int reg_a0 = 10;
-// free registers {t0 .. s1, a1, ... t6}
-static int reg_poll[] = { 5, 6, 7, 8, 9, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20,
-                          21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31 };
-static int next_free = 0;
+static void push_group(expjit_t j, ast_t x, unsigned e, int n)
+{
+        j->groups = reserve(j->groups, &j->groups_size, j->ngroups + 1, sizeof *j->groups);
+        j->groups[j->ngroups++] = (struct group) { x, e, n };
+}
 
-static void alloc(ast_t t)
+// x*a + x*x*b -> x*(a + x*b), making a group of all of m[0 .. n) for
+// each factor they all have
+static void take_common(expjit_t j, struct mono *m, int n)
 {
-        if (t->alloc) {
-                t->reg = t->alloc;
-                return;
+        int i, k, c;
+        struct atom *a;
+
+        // Their counts are no more use, so `next' is their group
+        for (i = 0; i < j->natoms; ++i)
+                if (j->atoms[i].count == n) {
+                        j->atoms[i].next = j->ngroups;
+                        push_group(j, j->atoms[i].x, UINT32_MAX, n);
+                }
+        for (i = 0; i < n; ++i)
+                for (k = 0; k < m[i].n; ++k)
+                        if ((a = atom(j, m[i].f[k].x))->count == n && j->groups[a->next].e > m[i].f[k].e)
+                                j->groups[a->next].e = m[i].f[k].e;
+
+        for (i = 0; i < n; ++i) {
+                for (k = c = 0; k < m[i].n; ++k) {
+                        if ((a = atom(j, m[i].f[k].x))->count == n)
+                                m[i].f[k].e -= j->groups[a->next].e;
+                        if (m[i].f[k].e)
+                                m[i].f[c++] = m[i].f[k];
+                }
+                m[i].n = c;
         }
-
-        assert(next_free < sizeof reg_poll / sizeof *reg_poll);
-        t->reg = reg_poll[next_free++];
 }
 
-static int use(ast_t t)
+// Rebuilds the sum of m[0 .. n), which have their like terms merged
+static ast_t factorise(expjit_t j, struct mono *m, int n, int depth)
 {
-        int r = t->reg;
+        int gbase = j->ngroups, cbase, nocc = 0, rest, i, k, c, g;
+        struct atom *a;
+        ast_t t;
 
-        assert(t->shared > 0);
-        t->shared--;
-        if (t->shared == 0) {
-                assert(0 < next_free);
-                reg_poll[--next_free] = r;
+        if (n < 2 || depth == FACTOR_DEPTH)
+                return sum(j, m, n);
+
+        if (count_factors(j, m, n)) {
+                take_common(j, m, n);
+                count_factors(j, m, n);
+        }
+        cbase = j->ngroups;
+
+        // List where the factors in more than one monomial are, and
+        // those factors by count, from j->heads[count]
+        j->heads = reserve(j->heads, &j->heads_size, n + 1, sizeof *j->heads);
+        for (c = 0; c <= n; ++c)
+                j->heads[c] = -1;
+        for (i = 0; i < j->natoms; ++i) {
+                a = &j->atoms[i];
+                a->occ = nocc;
+                a->nocc = 0;
+                if (a->count < 2)
+                        continue;
+                nocc += a->count;
+                a->next = j->heads[a->count];
+                j->heads[a->count] = i;
         }
+        j->occ = reserve(j->occ, &j->occ_size, nocc, sizeof *j->occ);
+        for (i = 0; i < n; ++i)
+                for (k = 0; k < m[i].n; ++k)
+                        if ((a = atom(j, m[i].f[k].x))->count >= 2)
+                                j->occ[a->occ + a->nocc++] = (struct place) { i, k };
+
+        // x*a + x*b + c -> x*(a + b) + c, for the factor in the most
+        // monomials left, as long as one is in more than one
+        for (c = n; c >= 2; --c)
+                while (j->heads[c] >= 0) {
+                        a = &j->atoms[j->heads[c]];
+                        j->heads[c] = a->next;
+                        if (a->count < c) {
+                                // Some of its monomials were taken since
+                                if (a->count >= 2) {
+                                        a->next = j->heads[a->count];
+                                        j->heads[a->count] = a - j->atoms;
+                                }
+                                continue;
+                        }
+
+                        const struct place *p, *end = &j->occ[a->occ + a->nocc];
+                        unsigned e = UINT32_MAX;
+                        for (p = &j->occ[a->occ]; p < end; ++p)
+                                if (m[p->i].group < 0 && m[p->i].f[p->k].e < e)
+                                        e = m[p->i].f[p->k].e;
+                        g = j->ngroups - cbase;
+                        push_group(j, a->x, e, c);
+                        for (p = &j->occ[a->occ]; p < end; ++p) {
+                                struct mono *mi = &m[p->i];
+                                if (mi->group >= 0)
+                                        continue;
+                                mi->group = g;
+                                mi->f[p->k].e -= e;
+                                for (k = 0; k < mi->n; ++k)
+                                        atom(j, mi->f[k].x)->count--;
+                        }
+                }
 
-        return r;
+        // Move the groups to the front, in order and without the power
+        // taken out, so each can be rebuilt in turn; j->heads[g] is
+        // where the next of group g goes
+        j->mtmp = reserve(j->mtmp, &j->mtmp_size, n, sizeof *j->mtmp);
+        for (rest = 0, g = cbase; g < j->ngroups; ++g) {
+                j->heads[g - cbase] = rest;
+                rest += j->groups[g].n;
+        }
+        for (i = 0, c = rest; i < n; ++i) {
+                struct mono *mi = &m[i];
+                if (mi->group < 0) {
+                        j->mtmp[c++] = *mi;
+                        continue;
+                }
+                for (k = g = 0; k < mi->n; ++k)
+                        if (mi->f[k].e)
+                                mi->f[g++] = mi->f[k];
+                mi->n = g;
+                g = mi->group;
+                mi->group = -1;
+                j->mtmp[j->heads[g]++] = *mi;
+        }
+        memcpy(m, j->mtmp, n * sizeof *m);
+
+        // Rebuilding a group may add groups of its own, and move these
+        t = sum(j, m + rest, n - rest);
+        for (i = 0, g = cbase; g < j->ngroups; ++g) {
+                struct group gr = j->groups[g];
+                ast_t s = factorise(j, m + i, gr.n, depth + 1);
+                t = mk(j, '+', t, times_power(j, s, gr.x, gr.e), 0);
+                i += gr.n;
+        }
+        for (g = gbase; g < cbase; ++g)
+                t = times_power(j, t, j->groups[g].x, j->groups[g].e);
+
+        j->ngroups = gbase;
+        return t;
 }
 
-static void codegen(ast_t t)
+static ast_t norm(expjit_t j, ast_t t)
 {
-        int hi = 0;
+        int mbase = j->nmonos, fbase = j->nfactors, n, i, k, c;
+        struct mono *m;
+        ast_t r;
+
+        if (KIND(t) == INT || KIND(t) == NAME)
+                return t;
+        if (CG(t).norm)
+                return CG(t).norm;
+
+        add_monos(j, t);
+
+        // Sort the factors, making repeated ones powers
+        m = &j->monos[mbase];
+        n = j->nmonos - mbase;
+        for (i = 0; i < n; ++i) {
+                struct power *f = m[i].f = &j->factors[m[i].first];
+                qsort(f, m[i].n, sizeof *f, cmp_power);
+                for (k = c = 0; k < m[i].n; ++k)
+                        if (c && f[c - 1].x == f[k].x)
+                                f[c - 1].e += f[k].e;
+                        else
+                                f[c++] = f[k];
+                m[i].n = c;
+        }
 
-        if (t->reg)
-                return;
+        // Add up like monomials, dropping any that come to nothing
+        qsort(m, n, sizeof *m, cmp_mono);
+        for (i = k = 0; i < n; ++i) {
+                if (k && cmp_mono(&m[k - 1], &m[i]) == 0)
+                        m[k - 1].coef += m[i].coef;
+                else
+                        m[k++] = m[i];
+                if (!m[k - 1].coef)
+                        k--;
+        }
 
-        switch (t->kind) {
-        case INT:
-                alloc(t);
+        r = factorise(j, m, k, 0);
 
-                hi = 0;
-                if (t->intValue & 0xFFFFF000) {
-                        // lui $reg, %hi(t->intValue)
-                        *cp++ = t->intValue & 0xFFFFF000 | t->reg << 7 | 0x37;
-                        hi = t->reg;
-                }
+        j->nmonos = mbase;
+        j->nfactors = fbase;
+        CG(r).norm = r;
+        CG(t).norm = r;
+        return r;
+}
 
-                // addi $reg, $hi, %lo(t->intValue)
-                *cp++ = (t->intValue & 0xFFF) << 20 | hi << 15 | t->reg << 7 | 0x13;
-                break;
 
-        case NAME:
-                alloc(t);
+/*
+ * Counting uses.
+ *
+ * With the expression complete, we walk the DAG from the root, visiting
+ * each node once and counting the edges into it, so nodes left behind
+ * by the rewrites in mk() count nothing even if CSE found them again.
+ * The root counts one use, by the caller.  Chains lean left, so those
+ * are walked by looping, as in mark().
+ */
+static void count_uses(expjit_t j, ast_t t)
+{
+        for (; ++CG(t).uses == 1; t = LEFT(t)) {
+                CG(t).shared = 1;
+                if (KIND(t) == INT)
+                        return;
+                if (KIND(t) == NAME) {
+                        j->vars[VALUE(t)] = t;
+                        return;
+                }
+                count_uses(j, RIGHT(t));
+        }
+        CG(t).shared = CG(t).uses;
+}
 
-                // We require a0 to hold a pointer to env
-                // lw $reg, off(t0)
-                *cp++ = (t->intValue * 4) << 20 | 2 << 12 | reg_a0 << 15 | t->reg << 7 | 0x03;
-                break;
 
-        case '+': {
-                codegen(t->l);
-                codegen(t->r);
+/*
+ * Tree-height reduction.
+ *
+ * The parser, and the canonical form in mk(), leave a sum of n terms as
+ * a chain of n - 1 additions each waiting for the one before, whereas
+ * the same additions as a balanced tree are only log2(n) deep, and a
+ * superscalar core can do those at the same level at the same time.
+ * So, with the uses counted, each chain, up to where it is shared, is
+ * rebuilt as a balanced tree of its terms.
+ *
+ * The price is registers: a balanced tree of 2^k terms holds k partial
+ * results while evaluating its last term, where a chain holds one.  So
+ * the terms are balanced in blocks small enough to evaluate without
+ * spilling, and the blocks chained.  Terms that are common
+ * subexpressions count against the registers too, as they are likely
+ * kept in one until their last use.
+ */
+static int label(expjit_t j, ast_t t);
 
-                int r = use(t->r);
-                int l = use(t->l);
-                alloc(t);
+// t is used once more, or once less
+static void hold(expjit_t j, ast_t t)
+{
+        CG(t).uses++;
+        CG(t).shared++;
+}
 
-                // add $l, $l, $r
-                *cp++ = r << 20 | l << 15 | t->reg << 7 | 0x33;
-                break;
+static void drop(expjit_t j, ast_t t)
+{
+        CG(t).uses--;
+        CG(t).shared--;
+}
+
+// l `kind' r, taking over a use of each.  Equal subtrees are found by
+// CSE as in mk(), but without its rewrites, which would undo the
+// balancing.  A node found that isn't used, left behind by mk() or by
+// balancing, is as good as a new one.
+static ast_t join(expjit_t j, token_t kind, ast_t l, ast_t r)
+{
+        ast_t *slot, t;
+
+        if (2 * (j->cse_count + 1) > j->cse_size)
+                cse_grow(j);
+        slot = cse_lookup(j, kind, l, r, 0);
+        if ((t = *slot) && CG(t).uses) {
+                drop(j, l);
+                drop(j, r);
+                hold(j, t);
+                return t;
+        }
+        if (!t) {
+                t = *slot = new_node(j, kind, l, r, 0);
+                j->cse_count++;
         }
+        CG(t).uses = CG(t).shared = 1;
+        return t;
+}
 
-        case '*': {
-                codegen(t->l);
-                codegen(t->r);
+static ast_t balanced(expjit_t j, token_t kind, ast_t *terms, int n)
+{
+        if (n == 1)
+                return terms[0];
 
-                int r = use(t->r);
-                int l = use(t->l);
-                alloc(t);
+        return join(j, kind, balanced(j, kind, terms, n / 2),
+                    balanced(j, kind, terms + n / 2, n - n / 2));
+}
 
-                // mul $reg, $reg, $(reg+1)
-                *cp++ =  1 << 25 | r << 20 | l << 15 | t->reg << 7 | 0x33;
-                break;
+static void balance(expjit_t j, ast_t t)
+{
+        int base = j->nterms, n, i, k, e, need, shared, block, rebuild;
+        ast_t c, b, *terms;
+
+        if (MARK(t) || KIND(t) == INT || KIND(t) == NAME)
+                return;
+        MARK(t) = 1;                    // done, as it may be shared
+
+        // Gather the terms, last first
+        for (c = t; KIND(c) == KIND(t) && (c == t || CG(c).uses == 1); c = LEFT(c))
+                push_term(j, RIGHT(c));
+        push_term(j, c);
+        n = j->nterms - base;
+
+        // A chain of three is as shallow as it gets, unless it has a
+        // power in it.  Otherwise the chain is to go, so its nodes are
+        // unused, which the terms may find by CSE and take over.
+        terms = &j->terms[base];
+        for (i = 1, rebuild = n > 3; i < n && !rebuild; ++i)
+                rebuild = terms[i] == terms[i - 1];
+        if (rebuild)
+                for (c = LEFT(t), i = 2; i < n; ++i, c = LEFT(c))
+                        CG(c).uses = CG(c).shared = 0;
+
+        for (i = 0; i < n; ++i)
+                balance(j, j->terms[base + i]);
+        if (!rebuild) {
+                for (i = 0; i < n; ++i)
+                        label(j, j->terms[base + i]);
+                j->nterms = base;
+                return;
         }
 
-        default:
-                assert(0);
+        // The terms equal to the one before, which are next to it in
+        // the canonical order, are raised to a power.  By halving, with
+        // the halves found again by CSE, x^8 is ((x*x)*(x*x))*(...), which
+        // is three multiplies.
+        terms = &j->terms[base];
+        for (i = k = 0; i < n; i += e) {
+                for (e = 1; i + e < n && terms[i + e] == terms[i]; ++e)
+                        ;
+                terms[k++] = balanced(j, KIND(t), terms + i, e);
+        }
+        n = k;
+
+        need = shared = 0;
+        for (i = 0; i < n; ++i) {
+                c = j->terms[base + i];
+                if (label(j, c) > need)
+                        need = label(j, c);
+                if (CG(c).uses > 1 && KIND(c) != INT)
+                        shared++;
+        }
+
+        terms = &j->terms[base];
+        for (i = 0; i < n / 2; ++i)
+                c = terms[i], terms[i] = terms[n - 1 - i], terms[n - 1 - i] = c;
+
+        // Blocks of 2^k terms need k more registers than the neediest
+        // term, plus one for the chain
+        for (block = 2; block < n && need + 2 + shared <= j->nregs; block *= 2)
+                need++;
+
+        b = balanced(j, KIND(t), terms, n < block ? n : block);
+        for (i = block; i < n; i += block)
+                b = join(j, KIND(t), b, balanced(j, KIND(t), terms + i, n - i < block ? n - i : block));
+
+        // t takes the place of b, and its uses of the operands, unless
+        // b is used elsewhere too
+        LEFT(t) = LEFT(b);
+        RIGHT(t) = RIGHT(b);
+        drop(j, b);
+        if (CG(b).uses) {
+                hold(j, LEFT(t));
+                hold(j, RIGHT(t));
         }
+
+        j->nterms = base;
 }
 
 
 /*
- * Main.
+ * Unparsing the AST.
+ *
+ * Both serving as an example of AST traversal and a debugging tool
+ * for examining the result of transformations.
  */
-
-// Allocates RWX memory of given size and returns a pointer to it. On failure,
-// prints out the error and returns NULL.
-void* alloc_executable_memory(size_t size)
+static void unparse(expjit_t j, ast_t t)
 {
-        void* ptr = mmap(0, size,
-                         PROT_READ | PROT_WRITE | PROT_EXEC,
-                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        if (ptr == (void*)-1) {
-                perror("mmap");
-                return NULL;
+        if (KIND(t) == INT)
+                printf("%d", VALUE(t));
+        else if (KIND(t) == NAME)
+                printf("%c", VALUE(t));
+        else {
+                printf("(");
+                if (CG(t).uses > 1)
+                        putchar('!');
+                unparse(j, LEFT(t));
+                printf("%c", KIND(t));
+                unparse(j, RIGHT(t));
+                printf(")");
         }
-        return ptr;
 }
 
 
+/*
+ * Code generation.
+ *
+ * Classic template expansion.  Rather than generating fully general
+ * code that stores to a stack, we pretend we have unlimited number of
+ * register and only go to the stack when we run out.
+ *
+ * Expressions are compiled to leave their results in registers
+ * corresponding to the depth of the stack.
+ *
+ * Common subexpressions are here treated as implicitly store to a
+ * local variable.  In a real compiler, this would be more explicit at
+ * a higher level, and no special treatment needed here.
+ *
+ * Ironically, it's actually much simpler to directly generate native
+ * x86 code here than some assembler output.
+ *
+ * Symbol table handling is unrealistically simplistic here.
+ *
+ * There is a code generator per target machine, all sharing the
+ * register handling below.  The context picks which one to use, by
+ * default the machine we run on.
+ */
 
+struct target {
+        const char *name;
+        const int *regs;                // the allocatable registers, in order of preference
+        int nregs;
+        const int *args;                // the integer argument registers
+        int nargs;
+        int reg_ret;                    // the result is returned here
+        unsigned callee_saved;          // registers we must preserve
+        int max_frame;                  // the largest stack frame we can address
+        int near_frame;                 // without the link register, see finish_frame()
+        int lr;                         // the link register, or NOREG
+        void (*codegen)(expjit_t j, ast_t t);
+        void (*spill)(expjit_t j, int reg, int slot);
+        void (*reload)(expjit_t j, int reg, int slot);
+        void (*frame)(expjit_t j, int size);    // sp += size
+        void (*li)(expjit_t j, int reg, int k); // reg = k
+        void (*ret)(expjit_t j);
+        void (*finish)(expjit_t j);     // final passes over the code, or NULL
+};
 
-typedef int (*int_function_pointer)(int *);
-
-int main(int argc, char **argv)
+/*
+ * The code is emitted into a buffer that grows as needed, so there is
+ * no limit on the size of the code.  Nothing else points into it, so
+ * moving it only takes moving `j->cp' along.
+ */
+static void emit8(expjit_t j, unsigned b)
 {
-        ast_t res;
-        s = "(1 + x*3 + 4*(5 + y)) * (1 + x*3 + 4*(5 + y))";
-        if (argc > 1)
-                s = argv[1];
-        nexttoken();
-        res = pExp();
-        if (lookahead) {
-                printf("Syntax error at:%s\n", s);
-                return -1;
+        if (j->cp == j->code_end) {
+                size_t used = j->cp - j->code, size = used ? 2 * used : 4096;
+                j->code = xrealloc(j->code, size);
+                j->cp = j->code + used;
+                j->code_end = j->code + size;
         }
-        unparse(res);
-        printf("\n");
 
-        cp = code = alloc_executable_memory(9999);
-        res->alloc = reg_a0;
-        codegen(res);
-        *cp++ = 0x8082; // c.ret
+        *j->cp++ = b;
+}
+
+static void emit16(expjit_t j, unsigned h)
+{
+        emit8(j, h);
+        emit8(j, h >> 8);
+}
 
-        asm("fence.i");
+static void emit32(expjit_t j, uint32_t w)
+{
+        emit16(j, w);
+        emit16(j, w >> 16);
+}
 
-        printf("%d instruction, value %d\n",
-               cp - code,
-               ((int_function_pointer) code)(env));  // cast the code pointer and call it.
+/*
+ * Register allocation.
+ *
+ * Registers are handed out as codegen walks the tree, in evaluation
+ * order, and a value keeps its register until its last use, as
+ * counted by `shared'.  When no register is free, the value in a
+ * register that was computed the longest ago is spilled to a slot in
+ * the stack frame.  For a tree that is the value needed furthest in
+ * the future; for common subexpressions it is a good guess.  Spilled
+ * values are reloaded at their next use, but keep their slot until
+ * dead, so each is stored at most once.
+ *
+ * The operands of the instruction being generated are pinned, so
+ * reloading one can't evict another, and their registers are only
+ * freed once the destination is allocated, which may then reuse one
+ * of them.
+ */
+
+static int generated(expjit_t j, ast_t t)
+{
+        return CG(t).reg != NOREG || CG(t).spill != NOSLOT;
+}
+
+static int new_slot(expjit_t j)
+{
+        if (j->nfree_slots)
+                return j->free_slots[--j->nfree_slots];
+
+        if (j->nslots == j->slots_size) {
+                j->slots_size = j->slots_size ? 2 * j->slots_size : 16;
+                j->free_slots = xrealloc(j->free_slots, j->slots_size * sizeof *j->free_slots);
+        }
+        return j->nslots++;
+}
+
+static void free_slot(expjit_t j, ast_t t)
+{
+        if (CG(t).spill != NOSLOT)
+                j->free_slots[j->nfree_slots++] = CG(t).spill;
+        CG(t).spill = NOSLOT;
+}
+
+static void make_live(expjit_t j, ast_t t, int r)
+{
+        assert(j->nlive < (int) (sizeof j->live / sizeof *j->live));
+        CG(t).reg = r;
+        j->live[j->nlive++] = t;
+        j->used_regs |= 1u << r;
+}
+
+static void kill(expjit_t j, int i)
+{
+        ast_t t = j->live[i];
+
+        memmove(&j->live[i], &j->live[i + 1], (--j->nlive - i) * sizeof *j->live);
+        CG(t).reg = NOREG;
+}
+
+// Moves the value in j->live[i] to the stack, returning its register.
+// Constants are just dropped, as loading one again is no dearer than
+// reloading it and saves the store.
+static int spill(expjit_t j, int i)
+{
+        ast_t t = j->live[i];
+        int r = CG(t).reg;
+
+        if (CG(t).spill == NOSLOT && KIND(t) != INT) {
+                CG(t).spill = new_slot(j);
+                j->target->spill(j, r, CG(t).spill);
+        }
+        kill(j, i);
+        return r;
+}
+
+static int pinned(expjit_t j, ast_t t)
+{
+        for (int i = 0; i < j->npinned; ++i)
+                if (j->pinned[i] == t)
+                        return 1;
+        return 0;
+}
+
+static int get_reg(expjit_t j)
+{
+        int i;
+
+        if (j->next_free < j->nregs)
+                return j->reg_poll[j->next_free++];
+
+        // Constants first, as they cost nothing to spill
+        for (i = 0; i < j->nlive; ++i)
+                if (!pinned(j, j->live[i]) && CG(j->live[i]).alloc == NOREG && KIND(j->live[i]) == INT)
+                        return spill(j, i);
+        for (i = 0; i < j->nlive; ++i)
+                if (!pinned(j, j->live[i]) && CG(j->live[i]).alloc == NOREG)
+                        return spill(j, i);
+
+        assert(0);
+        return NOREG;
+}
+
+static void alloc(expjit_t j, ast_t t)
+{
+        int i;
+
+        // The operands are read before the result is written, so the
+        // registers of those now dead can be reused right away.
+        for (i = 0; i < j->npinned; ++i) {
+                ast_t p = j->pinned[i];
+                if (CG(p).shared == 0 && CG(p).reg != NOREG) {
+                        j->reg_poll[--j->next_free] = CG(p).reg;
+                        for (int k = 0; k < j->nlive; ++k)
+                                if (j->live[k] == p) {
+                                        kill(j, k);
+                                        break;
+                                }
+                }
+        }
+        j->npinned = 0;
+
+        if (CG(t).alloc == NOREG) {
+                make_live(j, t, get_reg(j));
+                return;
+        }
+
+        // Take the desired register from the pool or whoever holds it
+        for (i = j->next_free; i < j->nregs; ++i)
+                if (j->reg_poll[i] == CG(t).alloc) {
+                        j->reg_poll[i] = j->reg_poll[j->next_free++];
+                        break;
+                }
+        for (i = 0; i < j->nlive; ++i)
+                if (CG(j->live[i]).reg == CG(t).alloc) {
+                        spill(j, i);
+                        break;
+                }
+        make_live(j, t, CG(t).alloc);
+}
+
+static int use(expjit_t j, ast_t t)
+{
+        assert(CG(t).shared > 0);
+        if (CG(t).reg == NOREG) {
+                int r = get_reg(j);
+                if (KIND(t) == INT)
+                        j->target->li(j, r, VALUE(t));  // see spill()
+                else
+                        j->target->reload(j, r, CG(t).spill);
+                make_live(j, t, r);
+        }
+
+        assert(j->npinned < (int) (sizeof j->pinned / sizeof *j->pinned));
+        j->pinned[j->npinned++] = t;
+        if (--CG(t).shared == 0)
+                free_slot(j, t);
+
+        return CG(t).reg;
+}
+
+// Like use(), but for a constant folded into an instruction instead
+// of being loaded into a register.  Generating the other operand may
+// have loaded it all the same, so it is pinned to free that register.
+static int use_imm(expjit_t j, ast_t t)
+{
+        assert(KIND(t) == INT && CG(t).shared > 0);
+        assert(j->npinned < (int) (sizeof j->pinned / sizeof *j->pinned));
+        j->pinned[j->npinned++] = t;
+        if (--CG(t).shared == 0)
+                free_slot(j, t);
+        return VALUE(t);
+}
+
+// A register for an intermediate value in the sequence of instructions
+// computing `t', which has just been allocated.  It must be given back
+// with put_scratch() before anything else is allocated.
+static int get_scratch(expjit_t j, ast_t t)
+{
+        int r;
+
+        j->pinned[j->npinned++] = t;    // keep get_reg() from spilling t
+        r = get_reg(j);
+        j->npinned--;
+        j->used_regs |= 1u << r;
+        return r;
+}
+
+static void put_scratch(expjit_t j, int r)
+{
+        j->reg_poll[--j->next_free] = r;
+}
+
+/*
+ * Variables as arguments.
+ *
+ * With expjit_set_args(), the variables used come in the argument
+ * registers, in alphabetical order, instead of in env.  They start out
+ * live there, as if already computed, so reading one costs nothing,
+ * and when its register is wanted for something else it is spilled
+ * like any other value.  An argument register that isn't allocatable,
+ * as it otherwise holds env, joins the pool.  A lone variable may need
+ * moving to where the result goes, which x + 0 does.
+ */
+static int bind_args(expjit_t j)
+{
+        int n = 0, c, i, r;
+
+        if (KIND(j->root) == NAME && j->target->args[0] != j->target->reg_ret) {
+                ast_t zero = new_node(j, INT, 0, 0, 0);
+
+                CG(zero).uses = CG(zero).shared = 1;
+                j->root = new_node(j, '+', j->root, zero, 0);
+                CG(j->root).uses = CG(j->root).shared = 1;
+        }
+
+        for (c = 0; c < 256; ++c) {
+                if (!j->vars[c])
+                        continue;
+                if (n == j->target->nargs) {
+                        snprintf(j->error, sizeof j->error, "More than %d variables to pass as arguments", n);
+                        return -1;
+                }
+                j->args[n] = c;
+                r = j->target->args[n++];
+
+                // Take r from the pool, or add it as taken
+                for (i = j->next_free; i < j->nregs && j->reg_poll[i] != r; ++i)
+                        ;
+                if (i < j->nregs)
+                        j->reg_poll[i] = j->reg_poll[j->next_free];
+                else
+                        j->reg_poll[j->nregs++] = j->reg_poll[j->next_free];
+                j->next_free++;
+                make_live(j, j->vars[c], r);
+        }
+        j->args[n] = 0;
+        return 0;
+}
+
+/*
+ * A compact env.
+ *
+ * env is indexed by the first character of a variable's name, which
+ * spreads the few variables an expression reads over several cache
+ * lines.  With expjit_set_compact(), each variable instead gets the
+ * next int of env as the code generator first reaches it, which is the
+ * order the expression first uses them, and the order is kept for the
+ * caller in j->layout.  The scheduler may still reorder the loads.
+ */
+static int env_index(expjit_t j, ast_t t)
+{
+        int i;
+
+        if (!j->compact)
+                return VALUE(t);
+
+        for (i = 0; j->layout[i] && j->layout[i] != VALUE(t); ++i)
+                ;
+        j->layout[i] = VALUE(t);
+        return i;
+}
+
+/*
+ * Evaluation order.
+ *
+ * The Sethi-Ullman number of a subtree is the number of registers
+ * needed to evaluate it without spilling.  Evaluating the operand with
+ * the larger number first means holding just one register while doing
+ * the other, where the opposite order could need one more throughout.
+ *
+ * In a DAG, a shared subtree costs nothing once evaluated, so the
+ * numbers are worked out once, as for a tree, and an operand already
+ * evaluated counts as needing no registers when deciding the order.
+ *
+ * Chains lean left, and may be too long to recurse down, so both here
+ * and in codegen() the left operands are stacked on j->terms and done
+ * from the bottom up.
+ */
+static int label(expjit_t j, ast_t t)
+{
+        int base = j->nterms, l, r;
+        ast_t c;
+
+        for (c = t; !CG(c).need && KIND(c) != INT && KIND(c) != NAME; c = LEFT(c))
+                push_term(j, c);
+        if (!CG(c).need)
+                CG(c).need = 1;
+
+        while (j->nterms > base) {
+                c = j->terms[--j->nterms];
+                l = CG(LEFT(c)).need;
+                r = label(j, RIGHT(c));
+                CG(c).need = l == r ? l + 1 : l > r ? l : r;
+        }
+        return CG(t).need;
+}
+
+static int need(expjit_t j, ast_t t)
+{
+        return generated(j, t) ? 0 : CG(t).need;
+}
+
+// Generates t, and first the chain of left operands below it, as far
+// as those are sure to go first (the targets may break ties otherwise)
+static void codegen(expjit_t j, ast_t t)
+{
+        int base = j->nterms;
+        ast_t c;
+
+        for (c = t; KIND(c) == KIND(t) && (KIND(c) == '+' || KIND(c) == '*') && !generated(j, c) &&
+                     need(j, RIGHT(c)) < need(j, LEFT(c)); c = LEFT(c))
+                push_term(j, c);
+        if (c == t)
+                j->target->codegen(j, t);
+
+        while (j->nterms > base)
+                j->target->codegen(j, j->terms[--j->nterms]);
+}
+
+static void codegen_operands(expjit_t j, ast_t t)
+{
+        if (need(j, RIGHT(t)) > need(j, LEFT(t))) {
+                codegen(j, RIGHT(t));
+                codegen(j, LEFT(t));
+        } else {
+                codegen(j, LEFT(t));
+                codegen(j, RIGHT(t));
+        }
+}
+
+/*
+ * With the body generated, we know what the frame holds: the spill
+ * slots and the callee saved registers we used.  The epilogue goes
+ * at the end, and the prologue is emitted there too, then rotated to
+ * the front.  Spill slots are addressed from the stack pointer after
+ * the prologue, so the body doesn't depend on the frame size.
+ *
+ * The slots of a frame bigger than `near_frame' are out of reach of a
+ * load or store on the stack pointer, or the frame is out of reach of
+ * a single adjustment of it.  The target then computes the address,
+ * or the size, in the link register, which for this is saved in 16
+ * bytes of its own above the frame.
+ */
+static void finish_frame(expjit_t j)
+{
+        unsigned saved = j->used_regs & j->target->callee_saved;
+        int nslots = j->nslots, size, far, r;
+        size_t body, prologue;
+
+        for (r = 0; r < 32; ++r)
+                if (saved & 1u << r)
+                        nslots++;
+
+        size = (nslots * 8 + 15) & ~15;
+        if (size > j->target->max_frame)
+                snprintf(j->error, sizeof j->error, "Expression too complex");
+        far = size > j->target->near_frame;
+        j->frame = size + 16 * far;
+
+        if (size) {
+                for (r = 0, nslots = j->nslots; r < 32; ++r)
+                        if (saved & 1u << r)
+                                j->target->reload(j, r, nslots++);
+                j->target->frame(j, size);
+                if (far) {
+                        j->target->reload(j, j->target->lr, 0);
+                        j->target->frame(j, 16);
+                }
+        }
+        j->target->ret(j);
+
+        body = j->cp - j->code;
+        if (size) {
+                if (far) {
+                        j->target->frame(j, -16);
+                        j->target->spill(j, j->target->lr, 0);
+                }
+                j->target->frame(j, -size);
+                for (r = 0, nslots = j->nslots; r < 32; ++r)
+                        if (saved & 1u << r)
+                                j->target->spill(j, r, nslots++);
+        }
+        prologue = j->cp - j->code - body;
+
+        if (prologue) {
+                uint8_t *tmp = xmalloc(prologue);
+                memcpy(tmp, j->code + body, prologue);
+                memmove(j->code + prologue, j->code, body);
+                memcpy(j->code, tmp, prologue);
+                free(tmp);
+        }
+}
+
+
+/*
+ * RISC-V RV64GC.
+ */
+
+// Instruction formats
+static uint32_t rv_r(int op, int f3, int f7, int rd, int rs1, int rs2)
+{
+        return f7 << 25 | rs2 << 20 | rs1 << 15 | f3 << 12 | rd << 7 | op;
+}
+
+static uint32_t rv_i(int op, int f3, int rd, int rs1, int imm)
+{
+        return (uint32_t) imm << 20 | rs1 << 15 | f3 << 12 | rd << 7 | op;
+}
+
+static uint32_t rv_s(int op, int f3, int rs1, int rs2, int imm)
+{
+        return (uint32_t) (imm >> 5 & 0x7F) << 25 | rs2 << 20 | rs1 << 15 | f3 << 12 | (imm & 31) << 7 | op;
+}
+
+static uint32_t rv_b(int f3, int rs1, int rs2, int imm)
+{
+        return (uint32_t) (imm >> 12 & 1) << 31 | (imm >> 5 & 0x3F) << 25 | rs2 << 20 | rs1 << 15 |
+                f3 << 12 | (imm >> 1 & 15) << 8 | (imm >> 11 & 1) << 7 | 0x63;
+}
+
+static uint32_t rv_u(int op, int rd, int imm)
+{
+        return (imm & 0xFFFFF000) | rd << 7 | op;
+}
+
+static uint32_t rv_j(int rd, int imm)
+{
+        return (uint32_t) (imm >> 20 & 1) << 31 | (imm >> 1 & 0x3FF) << 21 | (imm >> 11 & 1) << 20 |
+                (imm & 0xFF000) | rd << 7 | 0x6F;
+}
+
+static const int reg_ra = 1, reg_a0 = 10, reg_sp = 2;
+
+// RISC-V extensions the code may use besides RV64IM
+enum { RV_C = 1, RV_ZBA = 2 };
+
+// The cores we tune for, see expjit_set_tune().  Latencies are in
+// cycles from issue to a dependent instruction issuing, and everything
+// not listed takes one.
+struct rv_core {
+        const char *name;
+        int width;                      // instructions issued per cycle
+        int load, mul;
+};
+
+static const struct rv_core rv_cores[] = {
+        { "u74",  2, 3, 3 },            // SiFive U74, dual issue, in order
+        { "c910", 3, 4, 4 },            // T-Head C910, roughly
+};
+
+// free registers {t0 .. t2, a1 .. a7, t3 .. t6, s0 .. s11}, the callee
+// saved s registers last as they cost a save and a restore
+static const int rv64_regs[] = { 5, 6, 7, 11, 12, 13, 14, 15, 16, 17, 28, 29, 30, 31,
+                                 8, 9, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27 };
+
+// a0 .. a7
+static const int rv64_args[] = { 10, 11, 12, 13, 14, 15, 16, 17 };
+
+/*
+ * Constants.
+ *
+ * lui sets bits 31..12, sign extended, and addiw adds a sign extended
+ * 12-bit immediate, so the lui part is rounded up when the low part is
+ * negative, and addiw (not addi) wraps the sum into 32 bits as needed
+ * for constants just below 2^31.  A 64-bit constant is its upper bits
+ * shifted into place, plus an addi for the low 12; or, with leading
+ * zeros, the constant shifted up and filled with ones, then shifted
+ * back down, whichever is shorter.  These are the sequences of LLVM's
+ * RISCVMatInt without Zbb and Zbs.
+ */
+enum { RV_LI_MAX = 8 };
+
+// The instructions putting k in rd, returning how many there are
+static int rv_li_seq(int64_t k, int rd, uint32_t *seq)
+{
+        int64_t lo = (int64_t) ((uint64_t) k << 52) >> 52, hi;
+        uint32_t alt[RV_LI_MAX];
+        int n, m, sh;
+
+        if (k == (int32_t) k) {
+                int hi20 = (k + 0x800) >> 12 & 0xFFFFF;
+
+                n = 0;
+                if (hi20)
+                        seq[n++] = rv_u(0x37, rd, (uint32_t) hi20 << 12);       // lui $rd, hi20
+                if (lo && hi20)
+                        seq[n++] = rv_i(0x1B, 0, rd, rd, lo);                   // addiw $rd, $rd, lo
+                else if (!hi20)
+                        seq[n++] = rv_i(0x13, 0, rd, 0, lo);                    // li $rd, lo
+                return n;
+        }
+
+        // k = hi << sh + lo, where hi might get to be a lui if we keep
+        // 12 of the zeros
+        sh = __builtin_ctzll((uint64_t) k - lo);
+        hi = (int64_t) ((uint64_t) k - lo) >> sh;
+        if (sh > 12 && hi != (int64_t) ((uint64_t) hi << 52) >> 52 &&
+            (int64_t) ((uint64_t) hi << 12) == (int32_t) ((uint64_t) hi << 12)) {
+                sh -= 12;
+                hi = (int64_t) ((uint64_t) hi << 12);
+        }
+        n = rv_li_seq(hi, rd, seq);
+        seq[n++] = rv_i(0x13, 1, rd, rd, sh);                                   // slli $rd, $rd, sh
+        if (lo)
+                seq[n++] = rv_i(0x13, 0, rd, rd, lo);                           // addi $rd, $rd, lo
+
+        // k = (k << lz | ones) >> lz
+        if (k > 0) {
+                int lz = __builtin_clzll(k);
+                uint64_t up = (uint64_t) k << lz;
+
+                for (int ones = 1; ones >= 0; --ones) {
+                        m = rv_li_seq((int64_t) (ones ? up | ((1ull << lz) - 1) : up), rd, alt);
+                        if (m + 1 < n) {
+                                alt[m++] = rv_i(0x13, 5, rd, rd, lz);           // srli $rd, $rd, lz
+                                memcpy(seq, alt, m * sizeof *seq);
+                                n = m;
+                        }
+                }
+        }
+
+        return n;
+}
+
+// Instructions needed to put k in a register
+static int rv_li_cost(int64_t k)
+{
+        uint32_t seq[RV_LI_MAX];
+
+        return rv_li_seq(k, 0, seq);
+}
+
+static void rv64_li(expjit_t j, int reg, int k)
+{
+        uint32_t seq[RV_LI_MAX];
+        int n = rv_li_seq(k, reg, seq);
+
+        for (int i = 0; i < n; ++i)
+                emit32(j, seq[i]);
+}
+
+/*
+ * Multiplication by a constant.
+ *
+ * A mul takes several cycles on the in-order cores, where shifts and
+ * adds take one, so x*k is computed with a chain of those instead when
+ * that is quicker than materialising k and multiplying.  The chain
+ * works on an accumulator that starts out as x, and the shortest one
+ * is found by iterative deepening: an even k is the odd k' shifted,
+ * and an odd k is reached from k-1 or k+1 by adding or subtracting x
+ * or, with Zba, from (k-1)/2^s with sh<s>add or k/(2^s+1) with
+ * sh<s>add of the accumulator with itself.
+ */
+enum { RV_MUL_STEPS = 8 };
+
+struct rv_step {
+        enum { MUL_SLLI, MUL_ADD, MUL_SUB, MUL_NEG, MUL_SHADD, MUL_SHADD_SELF } op;
+        int sh;
+};
+
+// Finds a chain of at most `limit' steps multiplying by k, returning
+// the number of steps, or -1 if there is none.
+static int rv_mul_search(uint32_t k, int limit, int zba, struct rv_step *steps)
+{
+        int n, s;
+
+        if (k == 1)
+                return 0;
+        if (limit == 0)
+                return -1;
+
+        if (!(k & 1)) {
+                s = __builtin_ctz(k);
+                n = rv_mul_search(k >> s, limit - 1, zba, steps);
+                if (n < 0)
+                        return -1;
+                steps[n] = (struct rv_step) { MUL_SLLI, s };
+                return n + 1;
+        }
+
+        for (s = 1; zba && s <= 3; ++s) {
+                if (!((k - 1) & ((1u << s) - 1)) && (n = rv_mul_search((k - 1) >> s, limit - 1, zba, steps)) >= 0) {
+                        steps[n] = (struct rv_step) { MUL_SHADD, s };
+                        return n + 1;
+                }
+                if (k % ((1u << s) + 1) == 0 && (n = rv_mul_search(k / ((1u << s) + 1), limit - 1, zba, steps)) >= 0) {
+                        steps[n] = (struct rv_step) { MUL_SHADD_SELF, s };
+                        return n + 1;
+                }
+        }
+
+        if ((n = rv_mul_search(k - 1, limit - 1, zba, steps)) >= 0) {
+                steps[n] = (struct rv_step) { MUL_ADD, 0 };
+                return n + 1;
+        }
+        if (k + 1 && (n = rv_mul_search(k + 1, limit - 1, zba, steps)) >= 0) {
+                steps[n] = (struct rv_step) { MUL_SUB, 0 };
+                return n + 1;
+        }
+
+        return -1;
+}
+
+// The steps to multiply by the constant `k', or 0 if mul is quicker
+static int rv64_mul_chain(expjit_t j, ast_t k, struct rv_step *steps)
+{
+        int cost = j->core->mul, limit, n;
+        uint32_t u = VALUE(k);
+
+        if (CG(k).reg == NOREG)
+                cost += rv_li_cost(VALUE(k));
+
+        for (limit = 1; limit < cost && limit <= RV_MUL_STEPS; ++limit) {
+                if ((n = rv_mul_search(u, limit, j->isa & RV_ZBA, steps)) > 0)
+                        return n;
+                // x*-k as -(x*k)
+                if (limit > 1 && (int) u < 0 &&
+                    (n = rv_mul_search(-u, limit - 1, j->isa & RV_ZBA, steps)) > 0) {
+                        steps[n] = (struct rv_step) { MUL_NEG, 0 };
+                        return n + 1;
+                }
+        }
+
+        return 0;
+}
+
+static void rv64_mul_const(expjit_t j, ast_t t, const struct rv_step *steps, int n)
+{
+        int l = use(j, LEFT(t)), acc = l, dst, i;
+
+        use_imm(j, RIGHT(t));
+        alloc(j, t);
+
+        // The accumulator can only be t's register if that doesn't
+        // clobber x while the chain still needs it
+        dst = CG(t).reg;
+        for (i = 1; i < n; ++i)
+                if (dst == l && (steps[i].op == MUL_ADD || steps[i].op == MUL_SUB || steps[i].op == MUL_SHADD))
+                        dst = get_scratch(j, t);
+
+        for (i = 0; i < n; ++i) {
+                int rd = i == n - 1 ? CG(t).reg : dst;
+
+                switch (steps[i].op) {
+                case MUL_SLLI:
+                        emit32(j, rv_i(0x13, 1, rd, acc, steps[i].sh));         // slli $rd, $acc, sh
+                        break;
+                case MUL_ADD:
+                        emit32(j, rv_r(0x33, 0, 0, rd, acc, l));                // add $rd, $acc, $l
+                        break;
+                case MUL_SUB:
+                        emit32(j, rv_r(0x33, 0, 0x20, rd, acc, l));             // sub $rd, $acc, $l
+                        break;
+                case MUL_NEG:
+                        emit32(j, rv_r(0x33, 0, 0x20, rd, 0, acc));             // neg $rd, $acc
+                        break;
+                case MUL_SHADD:
+                        emit32(j, rv_r(0x33, 2 * steps[i].sh, 0x10, rd, acc, l));   // sh<s>add $rd, $acc, $l
+                        break;
+                case MUL_SHADD_SELF:
+                        emit32(j, rv_r(0x33, 2 * steps[i].sh, 0x10, rd, acc, acc)); // sh<s>add $rd, $acc, $acc
+                        break;
+                }
+                acc = rd;
+        }
+
+        if (dst != CG(t).reg)
+                put_scratch(j, dst);
+}
+
+// The steps to multiply by, if `t' is a product by a constant ending in
+// a shift that Zba's sh<s>add can do together with the add of `t' to
+// something, as nothing else uses `t', or else 0
+static int rv64_shadd_steps(expjit_t j, ast_t t, struct rv_step *steps)
+{
+        int n;
+
+        if (!(j->isa & RV_ZBA) || KIND(t) != '*' || KIND(RIGHT(t)) != INT ||
+            CG(t).shared != 1 || generated(j, t))
+                return 0;
+        n = rv64_mul_chain(j, RIGHT(t), steps);
+        return n && steps[n - 1].op == MUL_SLLI && steps[n - 1].sh <= 3 ? n : 0;
+}
+
+static void rv64_codegen(expjit_t j, ast_t t)
+{
+        if (generated(j, t))
+                return;
+
+        switch (KIND(t)) {
+        case INT:
+                alloc(j, t);
+                rv64_li(j, CG(t).reg, VALUE(t));
+                break;
+
+        case NAME:
+                alloc(j, t);
+
+                // We require a0 to hold a pointer to env
+                // lw $reg, off(t0)
+                emit32(j, (env_index(j, t) * 4) << 20 | 2 << 12 | reg_a0 << 15 | CG(t).reg << 7 | 0x03);
+                break;
+
+        case '+': {
+                // Constants on the right that fit go into the instruction
+                if (KIND(RIGHT(t)) == INT && VALUE(RIGHT(t)) >= -2048 && VALUE(RIGHT(t)) < 2048) {
+                        rv64_codegen(j, LEFT(t));
+                        int k = use_imm(j, RIGHT(t));
+                        int l = use(j, LEFT(t));
+                        alloc(j, t);
+
+                        // addi $reg, $l, k
+                        emit32(j, rv_i(0x13, 0, CG(t).reg, l, k));
+                        break;
+                }
+
+                // x*(k << s) + y -> sh<s>add of x*k and y
+                struct rv_step steps[RV_MUL_STEPS];
+                ast_t m = LEFT(t), a = RIGHT(t);
+                int n = rv64_shadd_steps(j, m, steps), x;
+
+                if (!n)
+                        m = RIGHT(t), a = LEFT(t), n = rv64_shadd_steps(j, m, steps);
+                if (n) {
+                        if (need(j, a) > need(j, m))
+                                codegen(j, a);
+                        codegen(j, LEFT(m));
+                        if (n > 1)
+                                rv64_mul_const(j, m, steps, n - 1);     // m holds x*k for now
+                        codegen(j, a);
+                        if (n > 1)
+                                x = use(j, m);
+                        else {
+                                CG(m).shared = 0;
+                                x = use(j, LEFT(m));
+                                use_imm(j, RIGHT(m));
+                        }
+                        int y = use(j, a);
+                        alloc(j, t);
+
+                        // sh<s>add $reg, $x, $y
+                        emit32(j, rv_r(0x33, 2 * steps[n - 1].sh, 0x10, CG(t).reg, x, y));
+                        break;
+                }
+
+                codegen_operands(j, t);
+
+                int r = use(j, RIGHT(t));
+                int l = use(j, LEFT(t));
+                alloc(j, t);
+
+                // add $l, $l, $r
+                emit32(j, r << 20 | l << 15 | CG(t).reg << 7 | 0x33);
+                break;
+        }
+
+        case '*': {
+                struct rv_step steps[RV_MUL_STEPS];
+                int n = KIND(RIGHT(t)) == INT ? rv64_mul_chain(j, RIGHT(t), steps) : 0;
+
+                if (n) {
+                        rv64_codegen(j, LEFT(t));
+                        rv64_mul_const(j, t, steps, n);
+                        break;
+                }
+
+                codegen_operands(j, t);
+
+                int r = use(j, RIGHT(t));
+                int l = use(j, LEFT(t));
+                alloc(j, t);
+
+                // mul $reg, $reg, $(reg+1)
+                emit32(j,  1 << 25 | r << 20 | l << 15 | CG(t).reg << 7 | 0x33);
+                break;
+        }
+
+        default:
+                assert(0);
+        }
+}
+
+// The register to address `slot' from, returning the offset.  Beyond
+// the 12-bit offsets, ra is free for that, see finish_frame().
+static int rv64_slot(expjit_t j, int slot, int *base)
+{
+        int off = slot * 8;
+
+        *base = reg_sp;
+        if (off < 2048)
+                return off;
+
+        emit32(j, rv_u(0x37, reg_ra, off + 0x800));             // lui ra, %hi(off)
+        emit32(j, rv_r(0x33, 0, 0, reg_ra, reg_ra, reg_sp));    // add ra, ra, sp
+        *base = reg_ra;
+        return off - ((off + 0x800) & ~0xFFF);
+}
+
+static void rv64_spill(expjit_t j, int reg, int slot)
+{
+        int base, off = rv64_slot(j, slot, &base);
+        emit32(j, rv_s(0x23, 3, base, reg, off));               // sd $reg, slot*8(sp)
+}
+
+static void rv64_reload(expjit_t j, int reg, int slot)
+{
+        int base, off = rv64_slot(j, slot, &base);
+        emit32(j, rv_i(0x03, 3, reg, base, off));               // ld $reg, slot*8(sp)
+}
+
+static void rv64_frame(expjit_t j, int size)
+{
+        uint32_t seq[RV_LI_MAX];
+        int n;
+
+        if (size >= -2048 && size < 2048) {
+                emit32(j, rv_i(0x13, 0, reg_sp, reg_sp, size)); // addi sp, sp, size
+                return;
+        }
+
+        n = rv_li_seq(size, reg_ra, seq);                       // li ra, size
+        for (int i = 0; i < n; ++i)
+                emit32(j, seq[i]);
+        emit32(j, rv_r(0x33, 0, 0, reg_sp, reg_sp, reg_ra));    // add sp, sp, ra
+}
+
+static void rv64_ret(expjit_t j)
+{
+        emit32(j, rv_i(0x67, 0, 0, reg_ra, 0));                 // ret (jalr zero, 0(ra))
+}
+
+/*
+ * Decoding.
+ *
+ * The scheduler works on the finished code, decoded back into
+ * instructions.  Only the part of RV64IM and Zba that we generate is
+ * decoded; anything else is left alone.
+ *
+ * There is no peephole pass over it, as there is nothing for one to
+ * find: the code generator makes no moves, nops, or dead values, and
+ * doesn't reload a value it just spilled.  The one rewrite that ever
+ * applied, a shift and an add into Zba's sh<s>add, is made by
+ * rv64_codegen() instead, which also gets the pairs that aren't next
+ * to each other.
+ */
+enum { RV_OTHER, RV_LUI, RV_ADDI, RV_ADDIW, RV_SLLI, RV_ADD, RV_SUB, RV_MUL,
+       RV_SHADD, RV_LW, RV_LD, RV_SD, RV_JALR };
+
+struct rv_insn {
+        int op, rd, rs1, rs2, imm;      // RV_SHADD has the shift in imm
+        uint32_t word;                  // as it was, for RV_OTHER
+};
+
+static struct rv_insn rv_decode(uint32_t w)
+{
+        struct rv_insn i = { RV_OTHER, w >> 7 & 31, w >> 15 & 31, w >> 20 & 31, (int32_t) w >> 20, w };
+        int f3 = w >> 12 & 7, f7 = w >> 25;
+
+        switch (w & 0x7F) {
+        case 0x37:
+                i.op = RV_LUI;
+                i.imm = w & 0xFFFFF000;
+                break;
+        case 0x13:
+                if (f3 == 0)
+                        i.op = RV_ADDI;
+                else if (f3 == 1 && f7 >> 1 == 0)
+                        i.op = RV_SLLI;
+                break;
+        case 0x1B:
+                if (f3 == 0)
+                        i.op = RV_ADDIW;
+                break;
+        case 0x33:
+                if (f3 == 0 && f7 == 0)
+                        i.op = RV_ADD;
+                else if (f3 == 0 && f7 == 0x20)
+                        i.op = RV_SUB;
+                else if (f3 == 0 && f7 == 1)
+                        i.op = RV_MUL;
+                else if (f7 == 0x10 && f3 && !(f3 & 1))
+                        i.op = RV_SHADD, i.imm = f3 / 2;
+                break;
+        case 0x03:
+                if (f3 == 2 || f3 == 3)
+                        i.op = f3 == 2 ? RV_LW : RV_LD;
+                break;
+        case 0x23:
+                if (f3 == 3)
+                        i.op = RV_SD, i.imm = (int32_t) (w & 0xFE000000) >> 20 | i.rd;
+                break;
+        case 0x67:
+                if (f3 == 0)
+                        i.op = RV_JALR;
+                break;
+        }
+
+        return i;
+}
+
+static uint32_t rv_encode(const struct rv_insn *i)
+{
+        switch (i->op) {
+        case RV_LUI:    return rv_u(0x37, i->rd, i->imm);
+        case RV_ADDI:   return rv_i(0x13, 0, i->rd, i->rs1, i->imm);
+        case RV_ADDIW:  return rv_i(0x1B, 0, i->rd, i->rs1, i->imm);
+        case RV_SLLI:   return rv_i(0x13, 1, i->rd, i->rs1, i->imm);
+        case RV_ADD:    return rv_r(0x33, 0, 0, i->rd, i->rs1, i->rs2);
+        case RV_SUB:    return rv_r(0x33, 0, 0x20, i->rd, i->rs1, i->rs2);
+        case RV_MUL:    return rv_r(0x33, 0, 1, i->rd, i->rs1, i->rs2);
+        case RV_SHADD:  return rv_r(0x33, 2 * i->imm, 0x10, i->rd, i->rs1, i->rs2);
+        case RV_LW:     return rv_i(0x03, 2, i->rd, i->rs1, i->imm);
+        case RV_LD:     return rv_i(0x03, 3, i->rd, i->rs1, i->imm);
+        case RV_SD:     return rv_s(0x23, 3, i->rs1, i->rs2, i->imm);
+        case RV_JALR:   return rv_i(0x67, 0, i->rd, i->rs1, i->imm);
+        default:        return i->word;
+        }
+}
+
+/*
+ * Instruction scheduling.
+ *
+ * The in-order cores stall an instruction until its operands are ready,
+ * so a load or a mul is best followed by something else for a few
+ * cycles.  The code is a single basic block and a list scheduler
+ * reorders it: of the instructions whose operands are ready, it issues
+ * the one with the longest chain of latencies behind it, so the loads,
+ * muls and adds of independent subexpressions interleave and the
+ * critical path goes first.  The latencies and issue width are those
+ * of the core we tune for.
+ *
+ * This runs after register allocation, so it cannot raise the register
+ * pressure: an instruction writing a register stays after the reads of
+ * its old value, and the stack slots are treated as one more register.
+ * Anything we don't decode stays where it is and the code on either
+ * side of it is scheduled on its own.
+ */
+enum { RV_MEM = 32 };
+
+struct rv_node {
+        int lat;                        // of its result
+        int height;                     // cycles from its issue to the end
+        int ready;                      // earliest cycle it can issue
+        int npreds;                     // not yet issued
+        int succs;                      // first edge out of it
+};
+
+struct rv_edge {
+        int to, lat, next;
+};
+
+// The better of two instructions to issue first, for the heaps: the
+// higher one, or the one ready sooner, and otherwise the earlier one
+static int rv_better(const struct rv_node *node, int a, int b, int by_height)
+{
+        if (by_height && node[a].height != node[b].height)
+                return node[a].height > node[b].height;
+        if (!by_height && node[a].ready != node[b].ready)
+                return node[a].ready < node[b].ready;
+        return a < b;
+}
+
+static void rv_heap_push(const struct rv_node *node, int *heap, int *n, int i, int by_height)
+{
+        int k, p;
+
+        for (k = (*n)++; k && rv_better(node, i, heap[p = (k - 1) / 2], by_height); k = p)
+                heap[k] = heap[p];
+        heap[k] = i;
+}
+
+static int rv_heap_pop(const struct rv_node *node, int *heap, int *n, int by_height)
+{
+        int top = heap[0], last = heap[--*n], k = 0, c;
+
+        while ((c = 2 * k + 1) < *n) {
+                if (c + 1 < *n && rv_better(node, heap[c + 1], heap[c], by_height))
+                        ++c;
+                if (!rv_better(node, heap[c], last, by_height))
+                        break;
+                heap[k] = heap[c];
+                k = c;
+        }
+        heap[k] = last;
+        return top;
+}
+
+// `to' can't issue until `lat' cycles after `from'
+static void rv_edge(struct rv_node *node, struct rv_edge *edge, int *nedges, int from, int to, int lat)
+{
+        edge[*nedges] = (struct rv_edge) { to, lat, node[from].succs };
+        node[from].succs = (*nedges)++;
+        node[to].npreds++;
+}
+
+// Schedules insn[lo .. hi), which has nothing we don't decode
+static void rv_schedule_block(expjit_t j, struct rv_insn *insn, int lo, int hi,
+                              struct rv_node *node, struct rv_edge *edge, int *list, struct rv_insn *out)
+{
+        int writer[RV_MEM + 1], readers[RV_MEM + 1];
+        int *avail = list, *wait = list + (hi - lo), *rnext = list + 2 * (hi - lo);
+        int i, k, e, r, nedges = 0, navail = 0, nwait = 0, cycle = 0, slots = 0, m;
+
+        for (r = 0; r <= RV_MEM; ++r)
+                writer[r] = readers[r] = -1;
+
+        // Dependences, on the registers read (at most two, the stack
+        // slots counting as one) and written
+        for (i = lo; i < hi; ++i) {
+                struct rv_insn *p = &insn[i];
+                int src[2] = { 0, 0 }, dst = p->op == RV_SD ? RV_MEM : p->rd;
+
+                switch (p->op) {
+                case RV_LUI:
+                        break;
+                case RV_LW:
+                case RV_LD:
+                        src[1] = p->rs1 == reg_sp || p->rs1 == reg_ra ? RV_MEM : 0;
+                        /* fall through */
+                case RV_ADDI:
+                case RV_ADDIW:
+                case RV_SLLI:
+                        src[0] = p->rs1;
+                        break;
+                default:
+                        src[0] = p->rs1;
+                        src[1] = p->rs2;
+                        break;
+                }
+
+                node[i] = (struct rv_node) {
+                        p->op == RV_LW || p->op == RV_LD ? j->core->load : p->op == RV_MUL ? j->core->mul : 1,
+                        0, 0, 0, -1
+                };
+
+                // The reads of each register since it was last written
+                // are listed by 2 * insn + operand
+                for (k = 0; k < 2; ++k)
+                        if ((r = src[k])) {
+                                if (writer[r] >= 0)
+                                        rv_edge(node, edge, &nedges, writer[r], i, node[writer[r]].lat);
+                                rnext[2 * (i - lo) + k] = readers[r];
+                                readers[r] = 2 * (i - lo) + k;
+                        }
+                if (dst) {
+                        if (writer[dst] >= 0)
+                                rv_edge(node, edge, &nedges, writer[dst], i, 1);
+                        for (e = readers[dst]; e >= 0; e = rnext[e])
+                                if (lo + e / 2 != i)
+                                        rv_edge(node, edge, &nedges, lo + e / 2, i, 0);
+                        writer[dst] = i;
+                        readers[dst] = -1;
+                }
+        }
+
+        for (i = hi; i-- > lo; ) {
+                node[i].height = node[i].lat;
+                for (e = node[i].succs; e >= 0; e = edge[e].next)
+                        if (node[i].height < edge[e].lat + node[edge[e].to].height)
+                                node[i].height = edge[e].lat + node[edge[e].to].height;
+                if (!node[i].npreds)
+                        rv_heap_push(node, wait, &nwait, i, 0);
+        }
+
+        // Issue cycle by cycle, the highest of what is ready first
+        for (m = lo; m < hi; ) {
+                while (nwait && node[wait[0]].ready <= cycle)
+                        rv_heap_push(node, avail, &navail, rv_heap_pop(node, wait, &nwait, 0), 1);
+                if (!navail) {
+                        cycle = node[wait[0]].ready;
+                        slots = 0;
+                        continue;
+                }
+
+                i = rv_heap_pop(node, avail, &navail, 1);
+                out[m++] = insn[i];
+                for (e = node[i].succs; e >= 0; e = edge[e].next) {
+                        struct rv_node *s = &node[edge[e].to];
+
+                        if (s->ready < cycle + edge[e].lat)
+                                s->ready = cycle + edge[e].lat;
+                        if (!--s->npreds)
+                                rv_heap_push(node, wait, &nwait, edge[e].to, 0);
+                }
+                if (++slots == j->core->width)
+                        ++cycle, slots = 0;
+        }
+
+        memcpy(insn + lo, out + lo, (hi - lo) * sizeof *insn);
+}
+
+static void rv64_schedule(expjit_t j, struct rv_insn *insn, int n)
+{
+        // Each instruction has at most two edges in for what it reads,
+        // one for what it writes, and two out to the next write of what
+        // it reads
+        struct rv_node *node = xmalloc(n * sizeof *node);
+        struct rv_edge *edge = xmalloc(5 * n * sizeof *edge);
+        struct rv_insn *out = xmalloc(n * sizeof *out);
+        int *list = xmalloc(4 * n * sizeof *list);
+        int lo, hi;
+
+        for (lo = 0; lo < n; lo = hi + 1) {
+                for (hi = lo; hi < n && insn[hi].op != RV_OTHER && insn[hi].op != RV_JALR; ++hi)
+                        ;
+                rv_schedule_block(j, insn, lo, hi, node, edge, list, out);
+        }
+
+        free(node);
+        free(edge);
+        free(out);
+        free(list);
+}
+
+
+/*
+ * Compressed instructions.
+ *
+ * The code generator only emits 32-bit instructions, and those that
+ * have a 16-bit form (RVC) are rewritten in a final pass, which keeps
+ * the rest of the back end simple.  There are no branches, so nothing
+ * needs fixing up when the code shrinks.
+ */
+
+// The registers x8 .. x15 that the 3-bit register fields can name
+static int rvc_reg(int r)
+{
+        return r >= 8 && r < 16;
+}
+
+static int rvc_imm6(int k)
+{
+        return k >= -32 && k < 32;
+}
+
+// CI format: op $rd, imm[5:0] and CR format: op $rd, $rs2
+static unsigned rvc_ci(int f3, int op, int rd, int imm)
+{
+        return f3 << 13 | (imm >> 5 & 1) << 12 | rd << 7 | (imm & 31) << 2 | op;
+}
+
+static unsigned rvc_cr(int f4, int rd, int rs2)
+{
+        return f4 << 12 | rd << 7 | rs2 << 2 | 2;
+}
+
+// The 16-bit form of `insn', or 0 if there is none
+static unsigned rvc_compress(uint32_t insn)
+{
+        int rd = insn >> 7 & 31, f3 = insn >> 12 & 7, rs1 = insn >> 15 & 31;
+        int rs2 = insn >> 20 & 31, f7 = insn >> 25;
+        int imm = (int32_t) insn >> 20;
+
+        switch (insn & 0x7F) {
+        case 0x03:
+                // c.lw $rd, imm($rs1)
+                if (f3 == 2 && rvc_reg(rd) && rvc_reg(rs1) && imm >= 0 && imm < 128 && !(imm & 3))
+                        return 2 << 13 | (imm >> 3 & 7) << 10 | (rs1 - 8) << 7 |
+                                (imm >> 2 & 1) << 6 | (imm >> 6 & 1) << 5 | (rd - 8) << 2;
+                // c.ldsp $rd, imm(sp)
+                if (f3 == 3 && rs1 == reg_sp && rd && imm >= 0 && imm < 512 && !(imm & 7))
+                        return 3 << 13 | (imm >> 5 & 1) << 12 | rd << 7 |
+                                (imm >> 3 & 3) << 5 | (imm >> 6 & 7) << 2 | 2;
+                break;
+
+        case 0x23:
+                // c.sdsp $rs2, imm(sp)
+                imm = (int32_t) (insn & 0xFE000000) >> 20 | rd;
+                if (f3 == 3 && rs1 == reg_sp && imm >= 0 && imm < 512 && !(imm & 7))
+                        return 7 << 13 | (imm >> 3 & 7) << 10 | (imm >> 6 & 7) << 7 | rs2 << 2 | 2;
+                break;
+
+        case 0x13:
+                if (f3 == 1 && rd == rs1 && rd && imm > 0 && imm < 64)
+                        return rvc_ci(0, 2, rd, imm);                   // c.slli $rd, imm
+                if (f3 != 0 || !rd)
+                        break;
+                if (!rs1 && rvc_imm6(imm))
+                        return rvc_ci(2, 1, rd, imm);                   // c.li $rd, imm
+                if (!imm && rs1)
+                        return rvc_cr(8, rd, rs1);                      // c.mv $rd, $rs1
+                if (rd == rs1 && rd == reg_sp && !(imm & 15) && imm >= -512 && imm < 512)
+                        return 3 << 13 | (imm >> 9 & 1) << 12 | reg_sp << 7 | (imm >> 4 & 1) << 6 |
+                                (imm >> 6 & 1) << 5 | (imm >> 7 & 3) << 3 | (imm >> 5 & 1) << 2 | 1;
+                if (rd == rs1 && rvc_imm6(imm))
+                        return rvc_ci(0, 1, rd, imm);                   // c.addi $rd, imm
+                break;
+
+        case 0x1B:
+                // c.addiw $rd, imm
+                if (f3 == 0 && rd == rs1 && rd && rvc_imm6(imm))
+                        return rvc_ci(1, 1, rd, imm);
+                break;
+
+        case 0x37:
+                // c.lui $rd, imm
+                imm = (int32_t) insn >> 12;
+                if (rd != reg_sp && rd && imm && rvc_imm6(imm))
+                        return rvc_ci(3, 1, rd, imm);
+                break;
+
+        case 0x33:
+                // c.sub $rd, $rs2
+                if (f3 == 0 && f7 == 0x20 && rd == rs1 && rvc_reg(rd) && rvc_reg(rs2))
+                        return 0x8C01 | (rd - 8) << 7 | (rs2 - 8) << 2;
+                if (f3 != 0 || f7 != 0 || !rd)
+                        break;
+                if (!rs1 && rs2)
+                        return rvc_cr(8, rd, rs2);                      // c.mv $rd, $rs2
+                if (rd == rs1 && rs2)
+                        return rvc_cr(9, rd, rs2);                      // c.add $rd, $rs2
+                if (rd == rs2 && rs1)
+                        return rvc_cr(9, rd, rs1);                      // c.add $rd, $rs1
+                break;
+
+        case 0x67:
+                // c.jr $rs1, which for ra is c.ret
+                if (f3 == 0 && !rd && rs1 && !imm)
+                        return rvc_cr(8, rs1, 0);
+                break;
+        }
+
+        return 0;
+}
+
+static void rv64_compress(expjit_t j)
+{
+        uint8_t *p, *end = j->cp;
+
+        // The code only shrinks, so it is rewritten in place
+        j->cp = j->code;
+        for (p = j->code; p < end; p += 4) {
+                uint32_t insn = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+                unsigned c = rvc_compress(insn);
+
+                if (c)
+                        emit16(j, c);
+                else
+                        emit32(j, insn);
+        }
+}
+
+static void rv64_finish(expjit_t j)
+{
+        int n = (j->cp - j->code) / 4, i;
+        struct rv_insn *insn = xmalloc(n * sizeof *insn);
+
+        for (i = 0; i < n; ++i) {
+                uint8_t *p = j->code + 4 * i;
+                insn[i] = rv_decode(p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24);
+        }
+        rv64_schedule(j, insn, n);
+
+        j->cp = j->code;
+        for (i = 0; i < n; ++i)
+                emit32(j, rv_encode(&insn[i]));
+        free(insn);
+
+        if (j->isa & RV_C)
+                rv64_compress(j);
+}
+
+/*
+ * The extensions to use come from an ISA string as for -march, eg.
+ * "rv64imc" or "rv64gc_zba", or just "rv64" for RV64IMC.  RV64I is
+ * required, and M as we multiply.  *isa is left alone if the string
+ * is rejected.
+ */
+static int rv64_isa(const char *name, unsigned *isa)
+{
+        const char *s = name + 4;
+        unsigned ext = 0;
+        int m = 0;
+
+        if (!*s) {
+                *isa = RV_C;
+                return 0;
+        }
+
+        if (*s != 'i' && *s != 'g')
+                return -1;
+        for (; *s && *s != '_'; ++s)
+                switch (*s) {
+                case 'g':
+                case 'm':
+                        m = 1;
+                        break;
+                case 'c':
+                        ext |= RV_C;
+                        break;
+                case 'i':
+                case 'a':
+                case 'f':
+                case 'd':
+                        break;
+                case 'b':
+                        ext |= RV_ZBA;
+                        break;
+                default:
+                        return -1;
+                }
+
+        // Multi-letter extensions, eg. _zba
+        while (*s == '_')
+                if (strncmp(s, "_zba", 4) == 0 && (!s[4] || s[4] == '_')) {
+                        ext |= RV_ZBA;
+                        s += 4;
+                } else
+                        return -1;
+
+        if (!m)
+                return -1;
+        *isa = ext;
+        return 0;
+}
+
+static const struct target rv64_target = {
+        "rv64", rv64_regs, sizeof rv64_regs / sizeof *rv64_regs,
+        rv64_args, sizeof rv64_args / sizeof *rv64_args, reg_a0,
+        0x0FFC0300, 1 << 30, 2032, reg_ra,      // s0 .. s11, 12-bit offsets
+        rv64_codegen, rv64_spill, rv64_reload, rv64_frame, rv64_li, rv64_ret, rv64_finish
+};
+
+
+/*
+ * x86-64, System V ABI.  The env pointer comes in rdi, the result
+ * goes in eax and the arithmetic is all 32-bit.
+ *
+ * The addressing modes make `lea' a three-operand add and a multiply
+ * by 2, 3, 4, 5, 8, and 9, which covers most of what we need.
+ */
+
+enum { X86_RAX, X86_RCX, X86_RDX, X86_RBX, X86_RSP, X86_RBP, X86_RSI, X86_RDI };
+// free registers {ecx, edx, esi, r8d .. r11d, eax}, eax last as it
+// is wanted for the result
+static const int x86_64_regs[] = { 1, 2, 6, 8, 9, 10, 11, 0 };
+
+// edi, esi, edx, ecx, r8d, r9d
+static const int x86_64_args[] = { X86_RDI, X86_RSI, X86_RDX, X86_RCX, 8, 9 };
+
+// REX prefix, if the ModRM reg, SIB index, or base register needs it
+static void x86_rex(expjit_t j, int reg, int index, int base)
+{
+        int rex = 0;
+
+        if (reg != NOREG && reg & 8)
+                rex |= 4;
+        if (index != NOREG && index & 8)
+                rex |= 2;
+        if (base != NOREG && base & 8)
+                rex |= 1;
+        if (rex)
+                emit8(j, 0x40 | rex);
+}
+
+// ModRM (and SIB) for the operand [base + index*scale + disp] where
+// either base or index may be missing.
+static void x86_mem(expjit_t j, int reg, int base, int index, int scale, int disp)
+{
+        int ss = scale == 8 ? 3 : scale == 4 ? 2 : scale == 2 ? 1 : 0;
+        int mod;
+
+        if (base == NOREG)
+                mod = 0;        // with SIB base = rbp this means disp32
+        else if (disp == 0 && (base & 7) != X86_RBP)
+                mod = 0;
+        else if (disp == (int8_t) disp)
+                mod = 1;
+        else
+                mod = 2;
+
+        if (index == NOREG && (base & 7) != X86_RSP)
+                emit8(j, mod << 6 | (reg & 7) << 3 | (base & 7));
+        else {
+                emit8(j, mod << 6 | (reg & 7) << 3 | X86_RSP);
+                emit8(j, ss << 6 |
+                      (index == NOREG ? X86_RSP : index & 7) << 3 |
+                      (base == NOREG ? X86_RBP : base & 7));
+        }
+
+        if (mod == 1)
+                emit8(j, disp);
+        else if (mod == 2 || base == NOREG)
+                emit32(j, disp);
+}
+
+// op $reg, $rm for one or two byte opcodes
+static void x86_rr(expjit_t j, unsigned op, int reg, int rm)
+{
+        x86_rex(j, reg, NOREG, rm);
+        if (op > 0xFF)
+                emit8(j, op >> 8);
+        emit8(j, op);
+        emit8(j, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+static void x86_lea(expjit_t j, int reg, int base, int index, int scale, int disp)
+{
+        x86_rex(j, reg, index, base);
+        emit8(j, 0x8D);
+        x86_mem(j, reg, base, index, scale, disp);
+}
+
+static void x86_64_li(expjit_t j, int reg, int k)
+{
+        if (k == 0)
+                // xor $reg, $reg
+                x86_rr(j, 0x31, reg, reg);
+        else {
+                // mov $reg, imm32
+                x86_rex(j, NOREG, NOREG, reg);
+                emit8(j, 0xB8 + (reg & 7));
+                emit32(j, k);
+        }
+}
+
+static void x86_64_codegen(expjit_t j, ast_t t)
+{
+        int l, r = NOREG, k = 0;
+
+        if (generated(j, t))
+                return;
+
+        switch (KIND(t)) {
+        case INT:
+                alloc(j, t);
+                x86_64_li(j, CG(t).reg, VALUE(t));
+                break;
+
+        case NAME:
+                alloc(j, t);
+
+                // mov $reg, off(%rdi)
+                x86_rex(j, CG(t).reg, NOREG, X86_RDI);
+                emit8(j, 0x8B);
+                x86_mem(j, CG(t).reg, X86_RDI, NOREG, 1, env_index(j, t) * 4);
+                break;
+
+        case '+':
+        case '*':
+                // Constants on the right go into the instruction
+                if (KIND(RIGHT(t)) == INT && CG(RIGHT(t)).reg == NOREG) {
+                        x86_64_codegen(j, LEFT(t));
+                        k = use_imm(j, RIGHT(t));
+                } else {
+                        codegen_operands(j, t);
+                        r = use(j, RIGHT(t));
+                }
+                l = use(j, LEFT(t));
+                alloc(j, t);
+
+                if (KIND(t) == '+')
+                        // lea $reg, (l + r) or (l + k)
+                        x86_lea(j, CG(t).reg, l, r, 1, k);
+                else if (r != NOREG) {
+                        // imul $reg, $l, $r (two address)
+                        if (CG(t).reg == r)
+                                r = l;
+                        else if (CG(t).reg != l)
+                                x86_rr(j, 0x8B, CG(t).reg, l);
+                        x86_rr(j, 0x0FAF, CG(t).reg, r);
+                } else if (k == 2)
+                        x86_lea(j, CG(t).reg, l, l, 1, 0);
+                else if (k == 3 || k == 5 || k == 9)
+                        x86_lea(j, CG(t).reg, l, l, k - 1, 0);
+                else if (k == 4 || k == 8)
+                        x86_lea(j, CG(t).reg, NOREG, l, k, 0);
+                else {
+                        // imul $reg, $l, imm
+                        x86_rr(j, k == (int8_t) k ? 0x6B : 0x69, CG(t).reg, l);
+                        if (k == (int8_t) k)
+                                emit8(j, k);
+                        else
+                                emit32(j, k);
+                }
+                break;
+
+        default:
+                assert(0);
+        }
+}
+
+static void x86_64_spill(expjit_t j, int reg, int slot)
+{
+        // mov slot*8(%rsp), $reg (64-bit)
+        emit8(j, 0x48 | (reg & 8) >> 1);
+        emit8(j, 0x89);
+        x86_mem(j, reg, X86_RSP, NOREG, 1, slot * 8);
+}
+
+static void x86_64_reload(expjit_t j, int reg, int slot)
+{
+        // mov $reg, slot*8(%rsp) (64-bit)
+        emit8(j, 0x48 | (reg & 8) >> 1);
+        emit8(j, 0x8B);
+        x86_mem(j, reg, X86_RSP, NOREG, 1, slot * 8);
+}
+
+static void x86_64_frame(expjit_t j, int size)
+{
+        // add/sub $size, %rsp
+        int n = size < 0 ? -size : size;
+        emit8(j, 0x48);
+        emit8(j, n < 128 ? 0x83 : 0x81);
+        emit8(j, size < 0 ? 0xEC : 0xC4);
+        if (n < 128)
+                emit8(j, n);
+        else
+                emit32(j, n);
+}
+
+static void x86_64_ret(expjit_t j)
+{
+        emit8(j, 0xC3); // ret
+}
+
+static const struct target x86_64_target = {
+        "x86_64", x86_64_regs, sizeof x86_64_regs / sizeof *x86_64_regs,
+        x86_64_args, sizeof x86_64_args / sizeof *x86_64_args, X86_RAX,
+        0, 1 << 30, 1 << 30, NOREG,     // we only use scratch registers
+        x86_64_codegen, x86_64_spill, x86_64_reload, x86_64_frame, x86_64_li, x86_64_ret, NULL
+};
+
+
+/*
+ * AArch64, AAPCS64.  The env pointer comes in x0 and the result goes
+ * in w0, which we can overwrite last as env is read by loads only.
+ * All arithmetic is on the 32-bit w registers.
+ *
+ * Besides adds of small constants going into the instruction, a
+ * product feeding an add (as in x*k1 + y, which mk() likes to make)
+ * becomes one multiply-add.
+ */
+
+// free registers {w1 .. w17}
+static const int arm64_regs[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17 };
+
+// w0 .. w7
+static const int arm64_args[] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+enum { ARM64_LR = 30, ARM64_ZR = 31, ARM64_SP = 31 };
+
+static void arm64_mov_imm(expjit_t j, int rd, int k)
+{
+        uint32_t lo = k & 0xFFFF, hi = (uint32_t) k >> 16;
+
+        if (hi == 0)
+                emit32(j, 0x52800000 | lo << 5 | rd);                   // movz $rd, lo
+        else if (lo == 0)
+                emit32(j, 0x52A00000 | hi << 5 | rd);                   // movz $rd, hi, lsl 16
+        else if (hi == 0xFFFF)
+                emit32(j, 0x12800000 | (~lo & 0xFFFF) << 5 | rd);       // movn $rd, ~lo
+        else if (lo == 0xFFFF)
+                emit32(j, 0x12A00000 | (~hi & 0xFFFF) << 5 | rd);       // movn $rd, ~hi, lsl 16
+        else {
+                emit32(j, 0x52800000 | lo << 5 | rd);                   // movz $rd, lo
+                emit32(j, 0x72A00000 | hi << 5 | rd);                   // movk $rd, hi, lsl 16
+        }
+}
+
+// Can k be the immediate of an add or sub?
+static int arm64_addimm(int k)
+{
+        unsigned u = k < 0 ? -(unsigned) k : (unsigned) k;
+
+        return u < 0x1000 || ((u & 0xFFF) == 0 && u < 0x1000000);
+}
+
+// A product only used by the add at hand, so it can be folded into it
+static int arm64_fusable(expjit_t j, ast_t t)
+{
+        return KIND(t) == '*' && CG(t).shared == 1 && !generated(j, t);
+}
+
+static void arm64_codegen(expjit_t j, ast_t t)
+{
+        int l, r, k;
+
+        if (generated(j, t))
+                return;
+
+        switch (KIND(t)) {
+        case INT:
+                alloc(j, t);
+                arm64_mov_imm(j, CG(t).reg, VALUE(t));
+                break;
+
+        case NAME:
+                alloc(j, t);
+
+                // ldr $reg, [x0, off]
+                emit32(j, 0xB9400000 | env_index(j, t) << 10 | 0 << 5 | CG(t).reg);
+                break;
+
+        case '+':
+                if (KIND(RIGHT(t)) == INT && CG(RIGHT(t)).reg == NOREG && arm64_addimm(VALUE(RIGHT(t)))) {
+                        arm64_codegen(j, LEFT(t));
+                        k = use_imm(j, RIGHT(t));
+                        l = use(j, LEFT(t));
+                        alloc(j, t);
+
+                        // add/sub $reg, $l, k{, lsl 12}
+                        unsigned u = k < 0 ? -(unsigned) k : (unsigned) k;
+                        emit32(j, (k < 0 ? 0x51000000 : 0x11000000) |
+                               (u < 0x1000 ? u << 10 : 1 << 22 | u >> 12 << 10) |
+                               l << 5 | CG(t).reg);
+                } else if (arm64_fusable(j, LEFT(t)) || arm64_fusable(j, RIGHT(t))) {
+                        ast_t m = arm64_fusable(j, LEFT(t)) ? LEFT(t) : RIGHT(t);
+                        ast_t a = m == LEFT(t) ? RIGHT(t) : LEFT(t);
+
+                        if (need(j, a) > need(j, m))
+                                arm64_codegen(j, a);
+                        codegen_operands(j, m);
+                        arm64_codegen(j, a);
+                        CG(m).shared = 0;
+                        int ra = use(j, a);
+                        r = use(j, RIGHT(m));
+                        l = use(j, LEFT(m));
+                        alloc(j, t);
+
+                        // madd $reg, $l, $r, $ra
+                        emit32(j, 0x1B000000 | r << 16 | ra << 10 | l << 5 | CG(t).reg);
+                } else {
+                        codegen_operands(j, t);
+                        r = use(j, RIGHT(t));
+                        l = use(j, LEFT(t));
+                        alloc(j, t);
+
+                        // add $reg, $l, $r
+                        emit32(j, 0x0B000000 | r << 16 | l << 5 | CG(t).reg);
+                }
+                break;
+
+        case '*':
+                codegen_operands(j, t);
+                r = use(j, RIGHT(t));
+                l = use(j, LEFT(t));
+                alloc(j, t);
+
+                // mul $reg, $l, $r (ie. madd with wzr)
+                emit32(j, 0x1B000000 | r << 16 | ARM64_ZR << 10 | l << 5 | CG(t).reg);
+                break;
+
+        default:
+                assert(0);
+        }
+}
+
+// The register to address `slot' from, returning the slot from there.
+// Beyond the scaled 12-bit offsets, x30 is free for that, see
+// finish_frame().
+static int arm64_slot(expjit_t j, int slot, int *base)
+{
+        *base = ARM64_SP;
+        if (slot < 4096)
+                return slot;
+
+        emit32(j, 0x91400000 | (slot >> 9) << 10 | ARM64_SP << 5 | ARM64_LR);  // add x30, sp, slot*8 & ~0xFFF
+        *base = ARM64_LR;
+        return slot & 511;
+}
+
+static void arm64_spill(expjit_t j, int reg, int slot)
+{
+        int base;
+        slot = arm64_slot(j, slot, &base);
+        emit32(j, 0xF9000000 | slot << 10 | base << 5 | reg);          // str $reg, [sp, slot*8]
+}
+
+static void arm64_reload(expjit_t j, int reg, int slot)
+{
+        int base;
+        slot = arm64_slot(j, slot, &base);
+        emit32(j, 0xF9400000 | slot << 10 | base << 5 | reg);          // ldr $reg, [sp, slot*8]
+}
+
+static void arm64_frame(expjit_t j, int size)
+{
+        uint32_t op = size < 0 ? 0xD1000000 : 0x91000000;
+        unsigned n = size < 0 ? -size : size;
+
+        // add/sub sp, sp, size, the upper 12 bits shifted by 12
+        if (n >> 12)
+                emit32(j, op | 1 << 22 | (n >> 12) << 10 | ARM64_SP << 5 | ARM64_SP);
+        if (n & 0xFFF)
+                emit32(j, op | (n & 0xFFF) << 10 | ARM64_SP << 5 | ARM64_SP);
+}
+
+static void arm64_ret(expjit_t j)
+{
+        emit32(j, 0xD65F03C0); // ret
+}
+
+static const struct target arm64_target = {
+        "arm64", arm64_regs, sizeof arm64_regs / sizeof *arm64_regs,
+        arm64_args, sizeof arm64_args / sizeof *arm64_args, 0,
+        0, 0xFFF000, 32768, ARM64_LR,   // only scratch registers, 12-bit offsets and add/sub immediates
+        arm64_codegen, arm64_spill, arm64_reload, arm64_frame, arm64_mov_imm, arm64_ret, NULL
+};
+
+
+static const struct target *const targets[] = { &rv64_target, &x86_64_target, &arm64_target };
+
+#if defined(__riscv) && __riscv_xlen == 64
+static const struct target *const host_target = &rv64_target;
+#elif defined(__x86_64__)
+static const struct target *const host_target = &x86_64_target;
+#elif defined(__aarch64__)
+static const struct target *const host_target = &arm64_target;
+#else
+static const struct target *const host_target = NULL; // cross compiling only
+#endif
+
+
+/*
+ * RISC-V simulator.
+ *
+ * An interpreter for RV64IMC, enough to run what rv64_codegen() makes
+ * on any host and to count what it does.  The simulated program sees
+ * host memory directly, so env is passed as is, and it runs until it
+ * returns to the (null) address it was called from.
+ *
+ * The cycles are counted as on an in-order core that issues up to its
+ * width of instructions a cycle, each waiting for its operands, with
+ * the latencies of struct rv_core.
+ */
+
+static int sext(uint32_t x, int bits)
+{
+        return (int32_t) (x << (32 - bits)) >> (32 - bits);
+}
+
+// The 32-bit instruction a compressed one stands for, or 0 (illegal)
+static uint32_t rvc_expand(uint16_t c)
+{
+        int rd = c >> 7 & 31, rs2 = c >> 2 & 31;        // full registers
+        int rd_ = 8 + (c >> 7 & 7), rs2_ = 8 + (c >> 2 & 7);    // x8 .. x15
+        int imm6 = sext((c >> 7 & 32) | (c >> 2 & 31), 6);
+
+        switch ((c & 3) << 3 | c >> 13) {
+        case 0x00: {    // c.addi4spn
+                int imm = (c >> 7 & 0x30) | (c >> 1 & 0x3C0) | (c >> 4 & 4) | (c >> 2 & 8);
+                return imm ? rv_i(0x13, 0, rs2_, 2, imm) : 0;
+        }
+        case 0x02:      // c.lw
+                return rv_i(0x03, 2, rs2_, rd_, (c >> 7 & 0x38) | (c >> 4 & 4) | (c << 1 & 0x40));
+        case 0x03:      // c.ld
+                return rv_i(0x03, 3, rs2_, rd_, (c >> 7 & 0x38) | (c << 1 & 0xC0));
+        case 0x06:      // c.sw
+                return rv_s(0x23, 2, rd_, rs2_, (c >> 7 & 0x38) | (c >> 4 & 4) | (c << 1 & 0x40));
+        case 0x07:      // c.sd
+                return rv_s(0x23, 3, rd_, rs2_, (c >> 7 & 0x38) | (c << 1 & 0xC0));
+
+        case 0x08:      // c.addi
+                return rv_i(0x13, 0, rd, rd, imm6);
+        case 0x09:      // c.addiw
+                return rd ? rv_i(0x1B, 0, rd, rd, imm6) : 0;
+        case 0x0A:      // c.li
+                return rv_i(0x13, 0, rd, 0, imm6);
+        case 0x0B:
+                if (rd == 2)    // c.addi16sp
+                        return rv_i(0x13, 0, 2, 2, sext((c >> 3 & 0x200) | (c >> 2 & 0x10) | (c << 1 & 0x40) |
+                                                        (c << 4 & 0x180) | (c << 3 & 0x20), 10));
+                return imm6 ? rv_u(0x37, rd, (uint32_t) imm6 << 12) : 0;   // c.lui
+        case 0x0C:
+                switch (c >> 10 & 3) {
+                case 0: return rv_i(0x13, 5, rd_, rd_, imm6 & 63);              // c.srli
+                case 1: return rv_i(0x13, 5, rd_, rd_, 0x400 | (imm6 & 63));    // c.srai
+                case 2: return rv_i(0x13, 7, rd_, rd_, imm6);                   // c.andi
+                }
+                switch ((c >> 10 & 4) | (c >> 5 & 3)) {
+                case 0: return rv_r(0x33, 0, 0x20, rd_, rd_, rs2_);     // c.sub
+                case 1: return rv_r(0x33, 4, 0, rd_, rd_, rs2_);        // c.xor
+                case 2: return rv_r(0x33, 6, 0, rd_, rd_, rs2_);        // c.or
+                case 3: return rv_r(0x33, 7, 0, rd_, rd_, rs2_);        // c.and
+                case 4: return rv_r(0x3B, 0, 0x20, rd_, rd_, rs2_);     // c.subw
+                case 5: return rv_r(0x3B, 0, 0, rd_, rd_, rs2_);        // c.addw
+                }
+                return 0;
+        case 0x0D:      // c.j
+                return rv_j(0, sext((c >> 1 & 0x800) | (c >> 7 & 0x10) | (c >> 1 & 0x300) | (c << 2 & 0x400) |
+                                    (c >> 1 & 0x40) | (c << 1 & 0x80) | (c >> 2 & 0xE) | (c << 3 & 0x20), 12));
+        case 0x0E:      // c.beqz
+        case 0x0F:      // c.bnez
+                return rv_b(c >> 13 & 1, rd_, 0,
+                            sext((c >> 4 & 0x100) | (c >> 7 & 0x18) | (c << 1 & 0xC0) | (c >> 2 & 6) | (c << 3 & 0x20), 9));
+
+        case 0x10:      // c.slli
+                return rv_i(0x13, 1, rd, rd, imm6 & 63);
+        case 0x12:      // c.lwsp
+                return rd ? rv_i(0x03, 2, rd, 2, (c >> 7 & 0x20) | (c >> 2 & 0x1C) | (c << 4 & 0xC0)) : 0;
+        case 0x13:      // c.ldsp
+                return rd ? rv_i(0x03, 3, rd, 2, (c >> 7 & 0x20) | (c >> 2 & 0x18) | (c << 4 & 0x1C0)) : 0;
+        case 0x14:
+                if (!(c & 0x1000))
+                        return rs2 ? rv_r(0x33, 0, 0, rd, 0, rs2)       // c.mv
+                                : rd ? rv_i(0x67, 0, 0, rd, 0) : 0;     // c.jr
+                if (rs2)
+                        return rv_r(0x33, 0, 0, rd, rd, rs2);           // c.add
+                return rd ? rv_i(0x67, 0, 1, rd, 0) : 0;                // c.jalr (not c.ebreak)
+        case 0x16:      // c.swsp
+                return rv_s(0x23, 2, 2, rs2, (c >> 7 & 0x3C) | (c >> 1 & 0xC0));
+        case 0x17:      // c.sdsp
+                return rv_s(0x23, 3, 2, rs2, (c >> 7 & 0x38) | (c >> 1 & 0x1C0));
+        }
+
+        return 0;
+}
+
+// Frames up to this size are kept on our own stack, bigger ones are
+// allocated for the call
+#define SIM_STACK 4096
+
+// The arguments are a0 .. a7, and the code takes `frame' bytes of stack
+static int rv64_simulate(const uint8_t *code, int frame, const struct rv_core *core, const int64_t a[8],
+                         struct expjit_sim_stats *st)
+{
+        uint64_t local[SIM_STACK / 8];
+        size_t size = frame > SIM_STACK ? frame : SIM_STACK;
+        uint64_t x[32] = { 0 }, *stack = frame > SIM_STACK ? xmalloc(size) : local;
+        uint64_t ready[32] = { 0 }, cycle = 0;          // when x[] is ready, and now
+        uintptr_t pc = (uintptr_t) code;
+        int slots = 0;
+
+        memset(st, 0, sizeof *st);
+        x[1] = 0;                                       // ra, where we stop
+        x[2] = (uintptr_t) stack + size;                // sp
+        memcpy(&x[10], a, 8 * sizeof *a);               // a0 .. a7
+
+        while (pc) {
+                const uint8_t *p = (const uint8_t *) pc;
+                uint32_t w = p[0] | p[1] << 8;
+                uintptr_t npc = pc + 2;
+
+                if ((w & 3) == 3)
+                        w |= (uint32_t) (p[2] | p[3] << 8) << 16, npc = pc + 4;
+                else
+                        w = rvc_expand(w);
+
+                int rd = w >> 7 & 31, f3 = w >> 12 & 7, f7 = w >> 25;
+                uint64_t a = x[w >> 15 & 31], b = x[w >> 20 & 31], v = 0;
+                int64_t imm = (int32_t) w >> 20;
+                int op = w & 0x7F, lat = 1;
+                uint64_t t = cycle;
+                void *addr;
+
+                st->insns++;
+                if (op != 0x37 && op != 0x17 && op != 0x6F && t < ready[w >> 15 & 31])
+                        t = ready[w >> 15 & 31];
+                if ((op == 0x33 || op == 0x3B || op == 0x23 || op == 0x63) && t < ready[w >> 20 & 31])
+                        t = ready[w >> 20 & 31];
+                if (t > cycle)
+                        cycle = t, slots = 0;
+                if (op == 0x03)
+                        lat = core->load;
+                else if ((op == 0x33 || op == 0x3B) && f7 == 1)
+                        lat = core->mul;
+
+                switch (w & 0x7F) {
+                case 0x37:      // lui
+                        v = (int32_t) (w & 0xFFFFF000);
+                        break;
+                case 0x17:      // auipc
+                        v = pc + (int32_t) (w & 0xFFFFF000);
+                        break;
+
+                case 0x13:      // addi, slli, ...
+                        switch (f3) {
+                        case 0: v = a + imm; break;
+                        case 1: v = a << (imm & 63); break;
+                        case 2: v = (int64_t) a < imm; break;
+                        case 3: v = a < (uint64_t) imm; break;
+                        case 4: v = a ^ imm; break;
+                        case 5: v = w >> 30 & 1 ? (uint64_t) ((int64_t) a >> (imm & 63)) : a >> (imm & 63); break;
+                        case 6: v = a | imm; break;
+                        case 7: v = a & imm; break;
+                        }
+                        break;
+                case 0x1B:      // addiw, slliw, ...
+                        switch (f3) {
+                        case 0: v = (int32_t) (a + imm); break;
+                        case 1: v = (int32_t) ((uint32_t) a << (imm & 31)); break;
+                        case 5: v = w >> 30 & 1 ? (int32_t) a >> (imm & 31) : (int32_t) ((uint32_t) a >> (imm & 31)); break;
+                        default: goto illegal;
+                        }
+                        break;
+
+                case 0x33:      // add, mul, ...
+                        if (f7 == 1) {
+                                if (f3 < 4)
+                                        st->muls++;
+                                switch (f3) {
+                                case 0: v = a * b; break;
+                                case 1: v = (__int128) (int64_t) a * (int64_t) b >> 64; break;
+                                case 2: v = (__int128) (int64_t) a * b >> 64; break;
+                                case 3: v = (unsigned __int128) a * b >> 64; break;
+                                case 4: v = !b ? (uint64_t) -1 : (int64_t) b == -1 ? -a : (uint64_t) ((int64_t) a / (int64_t) b); break;
+                                case 5: v = !b ? (uint64_t) -1 : a / b; break;
+                                case 6: v = !b ? a : (int64_t) b == -1 ? 0 : (uint64_t) ((int64_t) a % (int64_t) b); break;
+                                case 7: v = !b ? a : a % b; break;
+                                }
+                                break;
+                        }
+                        switch (f7 << 3 | f3) {
+                        case 0x000: v = a + b; break;
+                        case 0x100: v = a - b; break;
+                        case 0x001: v = a << (b & 63); break;
+                        case 0x002: v = (int64_t) a < (int64_t) b; break;
+                        case 0x003: v = a < b; break;
+                        case 0x004: v = a ^ b; break;
+                        case 0x005: v = a >> (b & 63); break;
+                        case 0x105: v = (int64_t) a >> (b & 63); break;
+                        case 0x006: v = a | b; break;
+                        case 0x007: v = a & b; break;
+                        case 0x082: v = (a << 1) + b; break;   // sh1add (Zba)
+                        case 0x084: v = (a << 2) + b; break;   // sh2add
+                        case 0x086: v = (a << 3) + b; break;   // sh3add
+                        default: goto illegal;
+                        }
+                        break;
+                case 0x3B:      // addw, mulw, ...
+                        switch (f7 << 3 | f3) {
+                        case 0x000: v = (int32_t) (a + b); break;
+                        case 0x100: v = (int32_t) (a - b); break;
+                        case 0x001: v = (int32_t) ((uint32_t) a << (b & 31)); break;
+                        case 0x005: v = (int32_t) ((uint32_t) a >> (b & 31)); break;
+                        case 0x105: v = (int32_t) a >> (b & 31); break;
+                        case 0x008: st->muls++; v = (int32_t) (a * b); break;
+                        default: goto illegal;
+                        }
+                        break;
+
+                case 0x03:      // lb, lh, lw, ld, lbu, lhu, lwu
+                        st->loads++;
+                        addr = (void *) (uintptr_t) (a + imm);
+                        switch (f3) {
+                        case 0: { int8_t   t; memcpy(&t, addr, 1); v = t; break; }
+                        case 1: { int16_t  t; memcpy(&t, addr, 2); v = t; break; }
+                        case 2: { int32_t  t; memcpy(&t, addr, 4); v = t; break; }
+                        case 3: { uint64_t t; memcpy(&t, addr, 8); v = t; break; }
+                        case 4: { uint8_t  t; memcpy(&t, addr, 1); v = t; break; }
+                        case 5: { uint16_t t; memcpy(&t, addr, 2); v = t; break; }
+                        case 6: { uint32_t t; memcpy(&t, addr, 4); v = t; break; }
+                        default: goto illegal;
+                        }
+                        break;
+                case 0x23:      // sb, sh, sw, sd
+                        if (f3 > 3)
+                                goto illegal;
+                        memcpy((void *) (uintptr_t) (a + ((int32_t) (w & 0xFE000000) >> 20 | rd)), &b, 1 << f3);
+                        rd = 0;
+                        break;
+
+                case 0x63:      // beq, bne, blt, bge, bltu, bgeu
+                        if (f3 == 2 || f3 == 3)
+                                goto illegal;
+                        if ((f3 < 2 ? a == b : f3 < 6 ? (int64_t) a < (int64_t) b : a < b) ^ (f3 & 1))
+                                npc = pc + ((int32_t) w >> 31 << 12 | (w >> 7 & 1) << 11 |
+                                            (w >> 25 & 0x3F) << 5 | (w >> 8 & 15) << 1);
+                        rd = 0;
+                        break;
+                case 0x67:      // jalr
+                        v = npc;
+                        npc = (a + imm) & ~(uint64_t) 1;
+                        break;
+                case 0x6F:      // jal
+                        v = npc;
+                        npc = pc + ((int32_t) w >> 31 << 20 | (w & 0xFF000) | (w >> 20 & 1) << 11 |
+                                    (w >> 21 & 0x3FF) << 1);
+                        break;
+
+                case 0x0F:      // fence
+                        rd = 0;
+                        break;
+
+                default:
+                illegal:
+                        fprintf(stderr, "illegal instruction %08x at +%d\n",
+                                w, (int) (pc - (uintptr_t) code));
+                        abort();
+                }
+
+                if (rd)
+                        x[rd] = v, ready[rd] = cycle + lat;
+                if (++slots == core->width)
+                        ++cycle, slots = 0;
+                pc = npc;
+        }
+
+        // Until the result is ready
+        st->cycles = cycle + !!slots > ready[10] ? cycle + !!slots : ready[10];
+        if (stack != local)
+                free(stack);
+        return x[10];
+}
+
+
+/*
+ * Code heap.
+ *
+ * Memory is never writable and executable at once: each region is a
+ * memfd mapped twice, read-write to copy code in and read-execute to
+ * run it.  Functions are carved out of the regions first fit and given
+ * back on release, coalescing with free neighbours, so regions are
+ * mapped once and then reused.  The heap is shared by all contexts
+ * and so guarded by a lock.
+ */
+
+#define REGION_SIZE (256 << 10)
+#define CODE_ALIGN  16
+
+struct block {
+        struct block *next;
+        size_t off, size;
+};
+
+struct region {
+        struct region *next;
+        uint8_t *rw, *rx;               // the two views of the same pages
+        size_t size;
+        struct block *free;             // sorted by offset
+};
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct region *heap;
+static size_t heap_mapped, heap_used;
+
+static struct region *new_region(size_t size)
+{
+        struct region *r;
+        void *rw, *rx;
+        int fd;
+
+        fd = memfd_create("expjit", MFD_CLOEXEC);
+        if (fd < 0) {
+                perror("memfd_create");
+                return NULL;
+        }
+        if (ftruncate(fd, size) < 0) {
+                perror("ftruncate");
+                close(fd);
+                return NULL;
+        }
+        rw = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        rx = mmap(0, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+        close(fd);
+        if (rw == MAP_FAILED || rx == MAP_FAILED) {
+                perror("mmap");
+                if (rw != MAP_FAILED)
+                        munmap(rw, size);
+                if (rx != MAP_FAILED)
+                        munmap(rx, size);
+                return NULL;
+        }
+
+        r = xmalloc(sizeof *r);
+        r->rw = rw;
+        r->rx = rx;
+        r->size = size;
+        r->free = xmalloc(sizeof *r->free);
+        r->free->next = NULL;
+        r->free->off = 0;
+        r->free->size = size;
+        return r;
+}
+
+// Finds room for `size' bytes of code, returning its region and offset
+static struct region *heap_alloc(size_t size, size_t *off)
+{
+        struct region *r;
+        struct block **bp, *b;
+
+        size = (size + CODE_ALIGN - 1) & ~(size_t) (CODE_ALIGN - 1);
+
+        pthread_mutex_lock(&heap_lock);
+        for (;;) {
+                for (r = heap; r; r = r->next)
+                        for (bp = &r->free; (b = *bp); bp = &b->next)
+                                if (b->size >= size) {
+                                        *off = b->off;
+                                        b->off += size;
+                                        b->size -= size;
+                                        if (!b->size) {
+                                                *bp = b->next;
+                                                free(b);
+                                        }
+                                        heap_used += size;
+                                        pthread_mutex_unlock(&heap_lock);
+                                        return r;
+                                }
+
+                // No room, so add a region big enough
+                size_t pagesize = sysconf(_SC_PAGESIZE);
+                r = new_region(size < REGION_SIZE ? REGION_SIZE : (size + pagesize - 1) & ~(pagesize - 1));
+                if (!r) {
+                        pthread_mutex_unlock(&heap_lock);
+                        return NULL;
+                }
+                r->next = heap;
+                heap = r;
+                heap_mapped += r->size;
+        }
+}
+
+static void heap_free(struct region *r, size_t off, size_t size)
+{
+        struct block **bp, *b, *prev = NULL;
+
+        size = (size + CODE_ALIGN - 1) & ~(size_t) (CODE_ALIGN - 1);
+
+        pthread_mutex_lock(&heap_lock);
+        heap_used -= size;
+        for (bp = &r->free; *bp && (*bp)->off < off; bp = &(*bp)->next)
+                prev = *bp;
+
+        if (prev && prev->off + prev->size == off)
+                prev->size += size;     // grow the block before
+        else {
+                b = xmalloc(sizeof *b);
+                b->off = off;
+                b->size = size;
+                b->next = *bp;
+                *bp = b;
+                prev = b;
+        }
+
+        b = prev->next;
+        if (b && prev->off + prev->size == b->off) {
+                prev->size += b->size;  // and merge with the one after
+                prev->next = b->next;
+                free(b);
+        }
+        pthread_mutex_unlock(&heap_lock);
+}
+
+void expjit_heap_stats(struct expjit_heap_stats *st)
+{
+        pthread_mutex_lock(&heap_lock);
+        st->mapped = heap_mapped;
+        st->used = heap_used;
+        st->largest_free = 0;
+        for (struct region *r = heap; r; r = r->next)
+                for (struct block *b = r->free; b; b = b->next)
+                        if (b->size > st->largest_free)
+                                st->largest_free = b->size;
+        pthread_mutex_unlock(&heap_lock);
+}
+
+
+/*
+ * Library interface, see expjit3.h.
+ */
+
+struct expjit_fn {
+        const struct target *target;
+        const struct rv_core *core;     // it was tuned for
+        int by_args;                    // takes args, not env
+        char args[9];
+        int compact;                    // env laid out as in layout
+        char layout[64];
+        uint8_t *code;                  // in the executable view of
+        struct region *region;          // this region of the code heap
+        size_t off, size;
+        int frame;                      // bytes of stack it takes
+};
+
+expjit_t expjit_new(void)
+{
+        expjit_t j = xmalloc(sizeof *j);
+
+        memset(j, 0, sizeof *j);
+        j->target = host_target ? host_target : &rv64_target;
+        j->isa = RV_C;
+        j->core = &rv_cores[0];
+        j->normal = 1;
+        return j;
+}
+
+void expjit_free(expjit_t j)
+{
+        for (unsigned i = 0; i < j->nchunks; ++i)
+                free(j->chunk[i]);
+        free(j->chunk);
+        free(j->cse_table);
+        free(j->roots);
+        free(j->monos);
+        free(j->mtmp);
+        free(j->factors);
+        free(j->atoms);
+        free(j->occ);
+        free(j->heads);
+        free(j->groups);
+        free(j->terms);
+        free(j->code);
+        free(j->free_slots);
+        free(j);
+}
+
+expjit_fn_t expjit_compile(expjit_t j, const char *source)
+{
+        expjit_fn_t f;
+
+        reset_nodes(j);
+        j->root = 0;
+        j->error[0] = 0;
+        j->s = source;
+        nexttoken(j);
+        j->root = pExp(j);
+        if (j->lookahead) {
+                snprintf(j->error, sizeof j->error, "Syntax error at:%s", j->s);
+                return NULL;
+        }
+
+        // Generate the code in j->code, then move it to the code heap
+        j->cp = j->code;
+        memcpy(j->reg_poll, j->target->regs, j->target->nregs * sizeof *j->reg_poll);
+        j->nregs = j->target->nregs;
+        j->next_free = 0;
+        j->nlive = j->npinned = 0;
+        j->used_regs = 0;
+        j->nfree_slots = j->nslots = 0;
+        memset(j->vars, 0, sizeof j->vars);
+        memset(j->layout, 0, sizeof j->layout);
+        if (j->normal)
+                j->root = norm(j, j->root);
+        count_uses(j, j->root);
+        balance(j, j->root);
+        if (j->by_args && bind_args(j) < 0)
+                return NULL;
+        CG(j->root).alloc = j->target->reg_ret;
+        label(j, j->root);
+        codegen(j, j->root);
+        finish_frame(j);
+        if (j->target->finish)
+                j->target->finish(j);
+        if (j->error[0])
+                return NULL;
+
+        f = xmalloc(sizeof *f);
+        f->target = j->target;
+        f->core = j->core;
+        f->by_args = j->by_args;
+        memcpy(f->args, j->args, sizeof f->args);
+        f->compact = j->compact && !j->by_args;
+        memcpy(f->layout, j->layout, sizeof f->layout);
+        f->size = j->cp - j->code;
+        f->frame = j->frame;
+        f->region = heap_alloc(f->size, &f->off);
+        if (!f->region) {
+                free(f);
+                snprintf(j->error, sizeof j->error, "Out of executable memory");
+                return NULL;
+        }
+        memcpy(f->region->rw + f->off, j->code, f->size);
+        f->code = f->region->rx + f->off;
+
+        // Make sure instruction fetch sees the new code (fence.i on
+        // RISC-V, cache maintenance on AArch64, nothing on x86)
+        if (j->target == host_target)
+                __builtin___clear_cache((char *) f->code, (char *) f->code + f->size);
+
+        return f;
+}
+
+int expjit_set_target(expjit_t j, const char *name)
+{
+        if (strncmp(name, "rv64", 4) == 0) {
+                if (rv64_isa(name, &j->isa) < 0)
+                        return -1;
+                j->target = &rv64_target;
+                return 0;
+        }
+
+        for (unsigned i = 0; i < sizeof targets / sizeof *targets; ++i)
+                if (strcmp(targets[i]->name, name) == 0) {
+                        j->target = targets[i];
+                        return 0;
+                }
+
+        return -1;
+}
+
+void expjit_set_args(expjit_t j, int on)
+{
+        j->by_args = on;
+}
+
+void expjit_set_compact(expjit_t j, int on)
+{
+        j->compact = on;
+}
+
+void expjit_set_normal(expjit_t j, int on)
+{
+        j->normal = on;
+}
+
+int expjit_set_tune(expjit_t j, const char *core)
+{
+        for (unsigned i = 0; i < sizeof rv_cores / sizeof *rv_cores; ++i)
+                if (strcmp(rv_cores[i].name, core) == 0) {
+                        j->core = &rv_cores[i];
+                        return 0;
+                }
+
+        return -1;
+}
+
+const char *expjit_error(expjit_t j)
+{
+        return j->error;
+}
+
+void expjit_dump(expjit_t j)
+{
+        if (j->root)
+                unparse(j, j->root);
+        printf("\n");
+}
+
+// The argument registers, from env
+static void get_args(expjit_fn_t f, int *env, int64_t a[8])
+{
+        memset(a, 0, 8 * sizeof *a);
+        if (!f->by_args)
+                a[0] = (intptr_t) env;
+        for (int i = 0; f->by_args && f->args[i]; ++i)
+                a[i] = env[(unsigned char) f->args[i]];
+}
+
+int expjit_call(expjit_fn_t f, int *env)
+{
+        struct expjit_sim_stats st;
+        int64_t a[8];
+
+        if (f->target == host_target && !f->by_args)
+                return ((expjit_entry_t) f->code)(env);
+
+        get_args(f, env, a);
+        if (f->target == host_target)
+                return ((expjit_args_entry_t) f->code)(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+
+        return expjit_simulate(f, env, &st);
+}
+
+int expjit_simulate(expjit_fn_t f, int *env, struct expjit_sim_stats *st)
+{
+        struct expjit_sim_stats dummy;
+        int64_t a[8];
+
+        if (f->target != &rv64_target) {
+                errno = ENOEXEC;
+                return 0;
+        }
+        get_args(f, env, a);
+        return rv64_simulate(f->code, f->frame, f->core, a, st ? st : &dummy);
+}
+
+expjit_entry_t expjit_entry(expjit_fn_t f)
+{
+        return f->target == host_target && !f->by_args ? (expjit_entry_t) f->code : NULL;
+}
+
+expjit_args_entry_t expjit_args_entry(expjit_fn_t f)
+{
+        return f->target == host_target && f->by_args ? (expjit_args_entry_t) f->code : NULL;
+}
+
+const char *expjit_args(expjit_fn_t f)
+{
+        return f->by_args ? f->args : NULL;
+}
+
+const char *expjit_layout(expjit_fn_t f)
+{
+        return f->compact ? f->layout : NULL;
+}
+
+const char *expjit_target(expjit_fn_t f)
+{
+        return f->target->name;
+}
+
+const void *expjit_code(expjit_fn_t f)
+{
+        return f->code;
+}
+
+size_t expjit_code_size(expjit_fn_t f)
+{
+        return f->size;
+}
+
+void expjit_release(expjit_fn_t f)
+{
+        heap_free(f->region, f->off, f->size);
+        free(f);
+}
+
+
+/*
+ * Main.
+ *
+ * A small driver for trying out the compiler.  Build with
+ * -DEXPJIT_NO_MAIN to embed the compiler as a library instead.
+ */
+
+#ifndef EXPJIT_NO_MAIN
+static int env[256] = { ['x'] = 2, ['y'] = 3 };
+
+int main(int argc, char **argv)
+{
+        expjit_t j = expjit_new();
+        expjit_fn_t f;
+        struct expjit_sim_stats st;
+        const char *machine = NULL, *layout;
+        int opt, simulate = 0, packed[64], *e = env;
+
+        while ((opt = getopt(argc, argv, "acm:Nst:")) != -1)
+                if (opt == 's')
+                        simulate = 1;
+                else if (opt == 'a')
+                        expjit_set_args(j, 1);
+                else if (opt == 'c')
+                        expjit_set_compact(j, 1);
+                else if (opt == 'N')
+                        expjit_set_normal(j, 0);
+                else if (opt == 'm')
+                        machine = optarg;
+                else if (opt != 't' || expjit_set_tune(j, optarg) < 0)
+                        goto usage;
+
+        // The simulator only runs RISC-V
+        if (simulate && !machine)
+                machine = "rv64";
+        if (machine && expjit_set_target(j, machine) < 0) {
+        usage:
+                fprintf(stderr, "usage: %s [-acNs] [-m rv64[imc][_zba]|x86_64|arm64] [-t u74|c910] [expression]\n", argv[0]);
+                return -1;
+        }
+
+        f = expjit_compile(j, optind < argc ? argv[optind] :
+                           "(1 + x*3 + 4*(5 + y)) * (1 + x*3 + 4*(5 + y))");
+        if (!f) {
+                printf("%s\n", expjit_error(j));
+                return -1;
+        }
+        expjit_dump(j);
+        if (expjit_args(f))
+                printf("f(%s)\n", expjit_args(f));
+
+        // A compact env holds just the variables used
+        if ((layout = expjit_layout(f))) {
+                printf("env {%s}\n", layout);
+                for (int i = 0; layout[i]; ++i)
+                        packed[i] = env[(unsigned char) layout[i]];
+                e = packed;
+        }
+
+        if ((expjit_entry(f) || expjit_args_entry(f)) && !simulate)
+                printf("%d bytes of code, value %d\n",
+                       (int) expjit_code_size(f),
+                       expjit_call(f, e));
+        else if (strcmp(expjit_target(f), "rv64") == 0) {
+                int v = expjit_simulate(f, e, &st);
+                printf("%d bytes of code, value %d (simulated: %lu instructions, %lu loads, %lu multiplies, %lu cycles)\n",
+                       (int) expjit_code_size(f), v, st.insns, st.loads, st.muls, st.cycles);
+        } else {
+                // Can't run it here, so show it instead
+                const uint8_t *code = expjit_code(f);
+                printf("%d bytes of code:", (int) expjit_code_size(f));
+                for (size_t i = 0; i < expjit_code_size(f); ++i)
+                        printf(" %02x", code[i]);
+                printf("\n");
+        }
 
+        expjit_release(f);
+        expjit_free(j);
         return 0;
 }
+#endif
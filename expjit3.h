@@ -0,0 +1,98 @@
+/*
+ * Embedding interface to the expjit3 expression compiler.
+ *
+ * A context compiles expressions into functions, each of which can be
+ * called any number of times with different environments, until it
+ * is released.  The environment is indexed by the (first) character
+ * of a variable name, eg. env['x'].
+ *
+ * Contexts are not thread safe, but threads can compile concurrently
+ * with a context each.  Compiled functions are independent of the
+ * context that made them and may outlive it.
+ */
+
+#ifndef EXPJIT3_H
+#define EXPJIT3_H
+
+#include <stddef.h>
+
+typedef struct expjit    *expjit_t;     // compiler context
+typedef struct expjit_fn *expjit_fn_t;  // compiled expression
+typedef int (*expjit_entry_t)(int *env);
+typedef int (*expjit_args_entry_t)(int, int, int, int, int, int, int, int);
+
+expjit_t expjit_new(void);
+void expjit_free(expjit_t j);
+
+// Returns NULL on failure, in which case expjit_error() tells why.
+expjit_fn_t expjit_compile(expjit_t j, const char *source);
+const char *expjit_error(expjit_t j);
+
+// Generate code for another machine ("rv64", "x86_64", "arm64") than the one we
+// run on.  Such code can be had from expjit_code(), but not called.
+// RISC-V takes an ISA string as for -march, eg. "rv64im" for no
+// compressed instructions or "rv64imc_zba" for shift-and-add
+// instructions too; "rv64" is RV64IMC.
+// Returns -1 for an unknown target, leaving the target as it was.
+int expjit_set_target(expjit_t j, const char *name);
+
+// Schedule RISC-V code for a core: "u74" (the default) or "c910".  The
+// simulator then counts cycles as that core would take them.  Returns
+// -1 for an unknown core.
+int expjit_set_tune(expjit_t j, const char *core);
+void expjit_dump(expjit_t j);   // print the last expression as transformed
+
+// Pass the variables as arguments, in registers, instead of in env.  A
+// function then takes the variables its expression uses, one int each
+// in alphabetical order, eg. f(x, y) for "x*y + x", as expjit_args()
+// tells.  Compiling fails for more than there are argument registers:
+// 8, or 6 on x86-64.
+void expjit_set_args(expjit_t j, int on);
+
+// Or lay out env compactly: the variables a function uses get one int
+// each from env[0] on, in the order the expression first uses them, as
+// expjit_layout() tells, eg. "yx" for env[0] = y and env[1] = x.  The
+// env of such a function is just strlen(expjit_layout(f)) ints.
+void expjit_set_compact(expjit_t j, int on);
+
+// Bring sums into polynomial normal form, taking out the factors
+// their terms share to save multiplies.  On by default.
+void expjit_set_normal(expjit_t j, int on);
+
+// Code for a foreign machine is run in the built-in RISC-V simulator
+// when it is rv64 and is not callable otherwise: for x86-64 or AArch64
+// code that doesn't run here, 0 comes back with errno set to ENOEXEC.
+// Functions taking arguments get them from env here, and a compact env
+// is as laid out.
+int expjit_call(expjit_fn_t f, int *env);
+expjit_entry_t expjit_entry(expjit_fn_t f);     // for calling directly, or NULL
+expjit_args_entry_t expjit_args_entry(expjit_fn_t f);   // likewise, taking arguments
+const char *expjit_args(expjit_fn_t f);         // the arguments, eg. "xy", or NULL
+const char *expjit_layout(expjit_fn_t f);       // a compact env, eg. "yx", or NULL
+const char *expjit_target(expjit_fn_t f);       // the machine it is for
+const void *expjit_code(expjit_fn_t f);
+size_t expjit_code_size(expjit_fn_t f);         // in bytes
+void expjit_release(expjit_fn_t f);
+
+// Run rv64 code in the simulator, which works on any host, counting
+// what it does.  `stats' may be NULL.  For code of another target, 0
+// comes back with errno set to ENOEXEC, and stats are left as they
+// were.
+struct expjit_sim_stats {
+        unsigned long insns;    // instructions retired
+        unsigned long loads;
+        unsigned long muls;
+        unsigned long cycles;   // on the core tuned for
+};
+int expjit_simulate(expjit_fn_t f, int *env, struct expjit_sim_stats *stats);
+
+// The executable memory shared by all compiled functions.  Its
+// fragmentation is 1 - largest_free / (mapped - used).
+struct expjit_heap_stats {
+        size_t mapped;          // bytes of memory held
+        size_t used;            // by live functions
+        size_t largest_free;    // the biggest function that fits without mapping more
+};
+void expjit_heap_stats(struct expjit_heap_stats *stats);
+
+#endif
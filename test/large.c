@@ -0,0 +1,135 @@
+/*
+ * Regression check for large expressions: compiles and runs sums and
+ * products of a million terms, some millions of nodes as parsed, which
+ * must neither overflow the C stack nor give the wrong value.  Products
+ * used again much later, which are spilled to a frame beyond the reach
+ * of a single load or store, are checked too.
+ *
+ *   cc -O2 -DEXPJIT_NO_MAIN -I.. large.c ../expjit3.c -o large
+ *   ./large [terms [target]]
+ *
+ * Code for a target that can't run here is only compiled.  Exits
+ * non-zero on any failure.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "expjit3.h"
+
+static int env[256] = { ['a'] = 3, ['b'] = 5, ['x'] = -7 };
+
+static const struct shape {
+        const char *name;
+        char op;                // joining the terms
+        const char *term;       // of k and l
+} shapes[] = {
+        { "sum of products", '+', "(a+%u)*(b+%u)" },
+        { "product of sums", '*', "(a+%u)" },
+        { "sum of multiples", '+', "x*%u" },
+};
+
+static int check(const struct shape *s, int n, const char *target)
+{
+        char *source = malloc((size_t) n * 24 + 1), *p = source;
+        unsigned a = env['a'], b = env['b'], x = env['x'];
+        unsigned want = s->op == '*';
+        expjit_t j = expjit_new();
+        expjit_fn_t f;
+
+        // The value with wrapping 32-bit arithmetic as we go; the sums
+        // in the product are odd so it doesn't wrap to 0
+        for (int i = 0; i < n; ++i) {
+                unsigned k = s->op == '*' ? 2 * (i % 50) : i % 100, l = i % 77;
+
+                if (i)
+                        *p++ = s->op;
+                p += sprintf(p, s->term, k, l);
+                if (s->op == '*')
+                        want *= a + k;
+                else
+                        want += s->term[0] == 'x' ? x * k : (a + k) * (b + l);
+        }
+
+        if (target && expjit_set_target(j, target) < 0) {
+                fprintf(stderr, "unknown target %s\n", target);
+                exit(2);
+        }
+        f = expjit_compile(j, source);
+        free(source);
+        if (!f) {
+                printf("%s, %d terms: %s\n", s->name, n, expjit_error(j));
+                expjit_free(j);
+                return 1;
+        }
+
+        int ok = 1;
+        printf("%s, %d terms: %zu bytes of code", s->name, n, expjit_code_size(f));
+        if (expjit_entry(f) || strcmp(expjit_target(f), "rv64") == 0) {
+                ok = expjit_call(f, env) == (int) want;
+                printf(", %s", ok ? "ok" : "WRONG");
+        }
+        printf("\n");
+
+        expjit_release(f);
+        expjit_free(j);
+        return !ok;
+}
+
+// p(0) + .. + p(n-1) + p(0)*p(n-1) + p(1)*p(n-2) + .., for p(i) = (a+i)*(b+i+1),
+// without the normal form, which would rather take the sums apart
+static int check_spills(int n, const char *target)
+{
+        char *source = malloc((size_t) n * 72 + 1), *p = source;
+        unsigned a = env['a'], b = env['b'], want = 0;
+        expjit_t j = expjit_new();
+        expjit_fn_t f;
+
+        for (int i = 0; i < 2 * n; ++i) {
+                unsigned k = i < n ? i : i - n, l = n - 1 - k;
+
+                if (i)
+                        *p++ = '+';
+                if (i < n) {
+                        p += sprintf(p, "((a+%u)*(b+%u))", k, k + 1);
+                        want += (a + k) * (b + k + 1);
+                } else {
+                        p += sprintf(p, "((a+%u)*(b+%u))*((a+%u)*(b+%u))", k, k + 1, l, l + 1);
+                        want += (a + k) * (b + k + 1) * ((a + l) * (b + l + 1));
+                }
+        }
+
+        if (target && expjit_set_target(j, target) < 0) {
+                fprintf(stderr, "unknown target %s\n", target);
+                exit(2);
+        }
+        expjit_set_normal(j, 0);
+        f = expjit_compile(j, source);
+        free(source);
+        if (!f) {
+                printf("shared products, %d terms: %s\n", 2 * n, expjit_error(j));
+                expjit_free(j);
+                return 1;
+        }
+
+        int ok = 1;
+        printf("shared products, %d terms: %zu bytes of code", 2 * n, expjit_code_size(f));
+        if (expjit_entry(f) || strcmp(expjit_target(f), "rv64") == 0) {
+                ok = expjit_call(f, env) == (int) want;
+                printf(", %s", ok ? "ok" : "WRONG");
+        }
+        printf("\n");
+
+        expjit_release(f);
+        expjit_free(j);
+        return !ok;
+}
+
+int main(int argc, char **argv)
+{
+        int n = argc > 1 ? atoi(argv[1]) : 1000000, bad = 0;
+
+        for (unsigned i = 0; i < sizeof shapes / sizeof *shapes; ++i)
+                bad += check(&shapes[i], n, argc > 2 ? argv[2] : NULL);
+        bad += check_spills(n / 10, argc > 2 ? argv[2] : NULL);
+        return bad != 0;
+}
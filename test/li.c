@@ -0,0 +1,106 @@
+/*
+ * Regression check for RISC-V constants: every 32-bit value, and a
+ * sample of 64-bit ones, is put in a register by the instructions
+ * rv_li_seq() gives and read back, by running those in the simulator
+ * in batches, each value stored to memory for comparing.  The
+ * sequences must also be no longer than they can be: one or two
+ * instructions for a 32-bit value and RV_LI_MAX for any.
+ *
+ * rv_li_seq() is internal, so this includes the compiler itself:
+ *
+ *   cc -O2 -I.. li.c -o li
+ *   ./li [64-bit values [step through the 32-bit ones]]
+ *
+ * All of the 32-bit values and ten million 64-bit ones take some
+ * minutes; a step of 1000 takes a second.  Exits non-zero on any
+ * failure.
+ */
+#define EXPJIT_NO_MAIN
+#include "expjit3.c"
+
+#define BATCH 65536
+#define PER_BASE 256            // stores at 0(a1) .. 2040(a1)
+
+static const int reg_t0 = 5, reg_a1 = 11;
+
+// Each value's sequence and sd, two addi a1 per PER_BASE values, and ret
+static uint8_t code[(BATCH * (RV_LI_MAX + 1) + BATCH / PER_BASE * 2 + 1) * 4];
+static int64_t got[BATCH];
+static long bad;                // values wrong, of which the first few are shown
+
+// Runs the sequences for k[0 .. n)
+static void check(const int64_t *k, int n, int max_len)
+{
+        uint8_t *p = code;
+        uint32_t seq[RV_LI_MAX + 3];
+        struct expjit_sim_stats st;
+        int64_t a[8] = { 0, (intptr_t) got };
+
+        for (int i = 0; i < n; ++i) {
+                int len = rv_li_seq(k[i], reg_t0, seq);
+
+                if (len > max_len && bad++ < 5)
+                        printf("%lld takes %d instructions\n", (long long) k[i], len);
+                seq[len++] = rv_s(0x23, 3, reg_a1, reg_t0, i % PER_BASE * 8);  // sd t0, off(a1)
+                if (i % PER_BASE == PER_BASE - 1) {
+                        seq[len++] = rv_i(0x13, 0, reg_a1, reg_a1, PER_BASE * 4);     // addi a1, a1, 1024
+                        seq[len++] = rv_i(0x13, 0, reg_a1, reg_a1, PER_BASE * 4);
+                }
+                for (int s = 0; s < len; ++s, p += 4)
+                        memcpy(p, &seq[s], 4);  // little endian, as the simulator reads it
+        }
+        uint32_t ret = rv_i(0x67, 0, 0, 1, 0);
+        memcpy(p, &ret, 4);
+
+        rv64_simulate(code, 0, &rv_cores[0], a, &st);
+        for (int i = 0; i < n; ++i)
+                if (got[i] != k[i] && bad++ < 5)
+                        printf("%lld comes out as %lld\n", (long long) k[i], (long long) got[i]);
+}
+
+// A 64-bit value with some structure, as constants tend to have
+static int64_t sample(void)
+{
+        uint64_t r = (uint64_t) rand() << 62 ^ (uint64_t) rand() << 31 ^ rand();
+
+        switch (rand() % 4) {
+        case 0:  return r;
+        case 1:  return r >> rand() % 64;                       // leading zeros
+        case 2:  return (int64_t) r >> rand() % 64;             // leading ones
+        default: return r << rand() % 64 ^ -(int64_t) (rand() % 2);     // trailing zeros or ones
+        }
+}
+
+int main(int argc, char **argv)
+{
+        static int64_t k[BATCH];
+        long n64 = argc > 1 ? atol(argv[1]) : 10000000, step = argc > 2 ? atol(argv[2]) : 1, bad32;
+        int n = 0;
+
+        if (step < 1) {
+                fprintf(stderr, "usage: %s [64-bit values [step through the 32-bit ones]]\n", argv[0]);
+                return 2;
+        }
+
+        for (int64_t v = INT32_MIN; v <= INT32_MAX; v += step) {
+                k[n++] = v;
+                if (n == BATCH || v + step > INT32_MAX) {
+                        check(k, n, 2);
+                        n = 0;
+                }
+        }
+        printf("32-bit values: %s\n", bad ? "WRONG" : "ok");
+
+        bad32 = bad;
+        srand(1);
+        for (long i = 0; i < n64; ++i) {
+                k[n++] = sample();
+                if (n == BATCH || i == n64 - 1) {
+                        check(k, n, RV_LI_MAX);
+                        n = 0;
+                }
+        }
+        printf("%ld 64-bit values: %s\n", n64, bad > bad32 ? "WRONG" : "ok");
+
+        return bad != 0;
+}